@@ -0,0 +1,204 @@
+#!/bin/bash
+#
+# enforce_bench.sh
+#	Benchmark the overhead of pg_quota's quota check on write workloads.
+#
+# Creates a scratch cluster and runs pgbench with the scripts in
+# bench/pgbench/ at increasing client counts, in three modes:
+#
+#   none      pg_quota not loaded, for the baseline
+#   idle      pg_quota loaded, the worker sleeping between cycles
+#   scanning  pg_quota loaded, with a large synthetic database directory
+#             and a short naptime, so that the worker is scanning, and
+#             updating the shared totals, most of the time
+#
+# While pgbench runs, pg_stat_activity is sampled to count the backends
+# waiting on pg_quota's locks. PostgreSQL has no counters for LWLock waits,
+# so the sample count is the best we have: divide it by active_samples to
+# get the fraction of time active backends spent waiting.
+#
+# Prints one JSON object per run on stdout.
+#
+# The extension must be installed first, with "make install".
+#
+# Environment variables:
+#   MODES          modes to run (default "none idle scanning")
+#   WORKLOADS      pgbench scripts to run (default "insert_single insert_multi
+#                  insert_partitioned copy")
+#   CLIENTS        client counts (default "1 4 16 64")
+#   DURATION       length of each run, in seconds (default 30)
+#   SEGMENTS       fake segments in the "scanning" mode (default 200000)
+#   COPY_ROWS      rows loaded by each COPY (default 1000)
+#   BENCH_DIR      scratch directory (default ./bench_data)
+#   BENCH_PORT     port of the scratch cluster (default 54329)
+
+set -e
+
+MODES=${MODES:-"none idle scanning"}
+WORKLOADS=${WORKLOADS:-"insert_single insert_multi insert_partitioned copy"}
+CLIENTS=${CLIENTS:-"1 4 16 64"}
+DURATION=${DURATION:-30}
+SEGMENTS=${SEGMENTS:-200000}
+COPY_ROWS=${COPY_ROWS:-1000}
+BENCH_DIR=${BENCH_DIR:-$(pwd)/bench_data}
+BENCH_PORT=${BENCH_PORT:-54329}
+
+SCRIPTDIR=$(cd "$(dirname "$0")" && pwd)/pgbench
+BINDIR=$(${PG_CONFIG:-pg_config} --bindir)
+PGDATA=$BENCH_DIR/data
+LOG=$BENCH_DIR/postmaster.log
+NCPU=$(nproc 2>/dev/null || echo 4)
+
+psql_cmd() {
+	"$BINDIR/psql" -X -A -t -q -p "$BENCH_PORT" -h "$BENCH_DIR" -d postgres -c "$1"
+}
+
+# Start the cluster with the settings for the given mode.
+start_cluster() {
+	local mode=$1
+	local opts="-p $BENCH_PORT -k $BENCH_DIR -c max_connections=200"
+
+	case $mode in
+		none)
+			;;
+		idle)
+			opts="$opts -c shared_preload_libraries=pg_quota -c pg_quota.refresh_naptime=3600"
+			;;
+		scanning)
+			opts="$opts -c shared_preload_libraries=pg_quota -c pg_quota.refresh_naptime=1"
+			;;
+	esac
+	"$BINDIR/pg_ctl" -D "$PGDATA" -l "$LOG" -w -o "$opts" start >/dev/null
+}
+
+stop_cluster() {
+	"$BINDIR/pg_ctl" -D "$PGDATA" -m fast -w stop >/dev/null
+}
+
+trap 'rm -f "$BENCH_DIR/sampling"; stop_cluster 2>/dev/null || true' EXIT
+
+# Fill the database directory with fake, sparse, segments for the
+# "scanning" mode, or remove them. Relfilenodes are allocated from a range
+# that the real ones won't reach, like in scan_bench.sh.
+fake_segments() {
+	local n=$1
+	perl -e '
+		my ($dir, $n) = @ARGV;
+		opendir(my $dh, $dir) or die;
+		unlink map { "$dir/$_" } grep { /^2[0-9]{9}/ } readdir($dh);
+		closedir($dh);
+		for (my $i = 0; $i < $n; $i++) {
+			my $path = sprintf("%s/%u", $dir, 2000000000 + $i);
+			open(my $fh, ">", $path) or die "could not create $path: $!";
+			truncate($fh, 8192 * (1 + int(rand(131072)))) or die;
+			close($fh);
+		}' "$PGDATA/base/$DBOID" "$n"
+}
+
+# Sample pg_stat_activity until $BENCH_DIR/sampling is removed. Each line
+# of the output has the number of backends waiting on a pg_quota lock, and
+# the number of active backends.
+sample_waits() {
+	while [ -f "$BENCH_DIR/sampling" ]; do
+		psql_cmd "SELECT count(*) FILTER (WHERE wait_event_type = 'LWLock' AND wait_event LIKE 'pg_quota%'),
+		                 count(*) FILTER (WHERE state = 'active' AND backend_type = 'client backend')
+		          FROM pg_stat_activity" || true
+		sleep 0.01
+	done
+}
+
+# The 99th percentile of the latencies in pgbench's transaction logs, in
+# milliseconds. The third field of each line is the latency in microseconds.
+p99_latency() {
+	cat "$BENCH_DIR"/pgbench_log.* | awk '{ print $3 }' | sort -n | awk '
+		{ lat[NR] = $1 }
+		END {
+			if (NR == 0) { print "null"; exit }
+			i = int(NR * 0.99 + 0.99);
+			if (i < 1) i = 1;
+			printf "%.3f\n", lat[i] / 1000.0
+		}'
+}
+
+run_one() {
+	local mode=$1
+	local workload=$2
+	local clients=$3
+	local script=$SCRIPTDIR/$workload.sql
+	local threads out tps p99 waits active sampler
+
+	if [ "$workload" = copy ]; then
+		script=$BENCH_DIR/copy.sql
+	fi
+	threads=$(( clients < NCPU ? clients : NCPU ))
+
+	rm -f "$BENCH_DIR"/pgbench_log.*
+	touch "$BENCH_DIR/sampling"
+	sample_waits > "$BENCH_DIR/wait_samples" &
+	sampler=$!
+
+	out=$(cd "$BENCH_DIR" && PGOPTIONS="-c search_path=bench" \
+		"$BINDIR/pgbench" -n -M prepared -p "$BENCH_PORT" -h "$BENCH_DIR" \
+			-c "$clients" -j "$threads" -T "$DURATION" -f "$script" \
+			--log --log-prefix="$BENCH_DIR/pgbench_log" postgres 2>&1)
+
+	rm -f "$BENCH_DIR/sampling"
+	wait "$sampler" || true
+
+	# PostgreSQL 11 prints "excluding connections establishing", later
+	# versions "without initial connection time".
+	tps=$(echo "$out" | awk '/^tps = .*(excluding|without)/ { print $3 }')
+	p99=$(p99_latency)
+	read -r waits active <<< "$(awk -F'|' '{ w += $1; a += $2 } END { print w + 0, a + 0 }' "$BENCH_DIR/wait_samples")"
+
+	printf '{"mode": "%s", "workload": "%s", "clients": %d, "duration_s": %d, "tps": %s, "p99_ms": %s, "lwlock_wait_samples": %d, "active_samples": %d}\n' \
+		"$mode" "$workload" "$clients" "$DURATION" "${tps:-null}" "$p99" "$waits" "$active"
+
+	# Keep the tables from growing without bounds between runs.
+	psql_cmd "TRUNCATE bench.bench_single, bench.bench_multi1, bench.bench_multi2,
+	                   bench.bench_multi3, bench.bench_multi4, bench.bench_part,
+	                   bench.bench_copy"
+}
+
+# Set up the scratch cluster.
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR"
+"$BINDIR/initdb" -D "$PGDATA" -A trust >/dev/null
+cat >> "$PGDATA/postgresql.conf" <<CONF
+pg_quota.databases = 'postgres'
+CONF
+
+start_cluster idle
+psql_cmd "CREATE EXTENSION pg_quota"
+"$BINDIR/psql" -X -q -p "$BENCH_PORT" -h "$BENCH_DIR" -d postgres -f "$SCRIPTDIR/setup.sql" >/dev/null
+DBOID=$(psql_cmd "SELECT oid FROM pg_database WHERE datname = 'postgres'")
+stop_cluster
+
+# The COPY script reads a file, whose absolute path isn't known until now.
+seq 1 "$COPY_ROWS" | awk '{ printf "%d,row %d\n", $1, $1 }' > "$BENCH_DIR/copy_data.csv"
+sed "s|@DATAFILE@|$BENCH_DIR/copy_data.csv|" "$SCRIPTDIR/copy.sql.in" > "$BENCH_DIR/copy.sql"
+
+for mode in $MODES; do
+	if [ "$mode" = scanning ]; then
+		fake_segments "$SEGMENTS"
+	else
+		fake_segments 0
+	fi
+
+	start_cluster "$mode"
+	if [ "$mode" != none ]; then
+		# Let the worker finish its initial scan, so that it doesn't skew
+		# the first run.
+		until [ -n "$(psql_cmd "SELECT 1 FROM quota.scan_stats WHERE cycles > 0")" ]; do
+			sleep 0.1
+		done
+	fi
+
+	for workload in $WORKLOADS; do
+		for clients in $CLIENTS; do
+			run_one "$mode" "$workload" "$clients"
+		done
+	done
+
+	stop_cluster
+done
@@ -0,0 +1,619 @@
+/* -------------------------------------------------------------------------
+ *
+ * fs_model_bench.c
+ *		Replay a trace of file observations through the fs_model data
+ *		structures, in a single process, and measure each kind of operation.
+ *
+ * fs_model.c only runs in a pg_quota worker, against shared memory that's
+ * set up at postmaster startup. This module #includes it, with the shared
+ * memory and named LWLock tranche calls redirected to local memory, and
+ * with stubs for the catalog lookups and directory scanning that live in
+ * the other files. model_bench.sh loads it into a single-user backend, so
+ * it runs with the real dynahash, memory contexts and LWLocks, and with
+ * nothing else running.
+ *
+ * A trace has one operation per line:
+ *
+ *	A <path> <size>			a file that's not in the model yet
+ *	U <path> <size>			a file that's in the model already
+ *	R <path>				a file that was removed
+ *	O <spc> <db> <rel> <owner>	the owner of a relfilenode was looked up
+ *	G						a new scan starts
+ *	S						sweep the files not seen in this scan
+ *
+ * Paths are relative to the data directory, like "base/13212/16384.1". A
+ * and U both go through UpdateFileSize(), and are only told apart so that
+ * inserts and updates are reported separately. record_trace.sh records a
+ * trace from a live data directory. Without one, a synthetic trace is
+ * generated.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+
+/*
+ * Redirect fs_model.c's shared memory calls to local memory. The headers
+ * are included first, so that only the calls are renamed.
+ */
+#define ShmemInitStruct(name, size, foundPtr) \
+	bench_ShmemInitStruct(name, size, foundPtr)
+#define ShmemInitHash(name, init_size, max_size, infoP, hash_flags) \
+	bench_ShmemInitHash(name, init_size, max_size, infoP, hash_flags)
+#define GetNamedLWLockTranche(tranche_name) \
+	bench_GetNamedLWLockTranche(tranche_name)
+
+static void *bench_ShmemInitStruct(const char *name, Size size, bool *foundPtr);
+static HTAB *bench_ShmemInitHash(const char *name, long init_size, long max_size,
+					HASHCTL *infoP, int hash_flags);
+static LWLockPadded *bench_GetNamedLWLockTranche(const char *tranche_name);
+
+#include "../fs_model.c"
+
+PG_MODULE_MAGIC;
+
+PG_FUNCTION_INFO_V1(fs_model_bench);
+
+/* Relfilenodes of synthetic relations, from a range real ones won't reach */
+#define SYNTHETIC_RELNODE_BASE	2000000000
+
+typedef enum BenchOpType
+{
+	BENCH_OP_ADD,
+	BENCH_OP_UPDATE,
+	BENCH_OP_REMOVE,
+	BENCH_OP_OWNER,
+	BENCH_OP_GENERATION,
+	BENCH_OP_SWEEP,
+	NUM_BENCH_OPS
+} BenchOpType;
+
+static const char *const bench_op_names[NUM_BENCH_OPS] = {
+	"add", "update", "remove", "owner", "generation", "sweep"
+};
+
+typedef struct BenchOp
+{
+	BenchOpType type;
+	RelFileNode rnode;			/* relation of the file, or for 'owner' */
+	char	   *path;			/* for 'add', 'update' and 'remove' */
+	off_t		size;			/* for 'add' and 'update' */
+	Oid			owner;			/* for 'owner' */
+} BenchOp;
+
+typedef struct BenchTrace
+{
+	BenchOp    *ops;
+	int			nops;
+	int			maxops;
+} BenchTrace;
+
+typedef struct BenchResult
+{
+	int64		count;			/* operations, or files visited by sweeps */
+	double		seconds;
+	int64		cache_misses;
+	int64		peak_model_bytes;
+} BenchResult;
+
+/*
+ * Stubs for the shared memory and LWLock tranche calls in fs_model.c.
+ */
+static void *
+bench_ShmemInitStruct(const char *name, Size size, bool *foundPtr)
+{
+	*foundPtr = false;
+	return MemoryContextAllocZero(TopMemoryContext, size);
+}
+
+static HTAB *
+bench_ShmemInitHash(const char *name, long init_size, long max_size,
+					HASHCTL *infoP, int hash_flags)
+{
+	return hash_create(name, init_size, infoP, hash_flags);
+}
+
+static LWLockPadded *
+bench_GetNamedLWLockTranche(const char *tranche_name)
+{
+	LWLockPadded *lock;
+	int			tranche_id = LWLockNewTrancheId();
+
+	/* fs_model.c requests two locks */
+	lock = MemoryContextAllocZero(TopMemoryContext, 2 * sizeof(LWLockPadded));
+	LWLockRegisterTranche(tranche_id, tranche_name);
+	LWLockInitialize(&lock[0].lock, tranche_id);
+	LWLockInitialize(&lock[1].lock, tranche_id);
+
+	return lock;
+}
+
+/*
+ * Stubs for the functions in the other files that fs_model.c calls. Owners
+ * only come from the trace, and nothing scans directories.
+ */
+bool
+get_relfilenode_info(RelFileNode *rnode, RelFileInfo *info)
+{
+	return false;
+}
+
+List *
+get_role_members(Oid groupid)
+{
+	return NIL;
+}
+
+List *
+ParallelScanDirs(List *dirs, int nworkers, ScanFileCallback callback,
+				 int64 *dirs_scanned, int64 *stat_calls)
+{
+	return dirs;
+}
+
+void
+StatBatchBegin(ScanFileCallback callback)
+{
+}
+
+void
+StatBatchAdd(RelFileNode *rnode, const char *path)
+{
+}
+
+void
+StatBatchFlush(void)
+{
+}
+
+/*
+ * Append an operation to the trace.
+ */
+static BenchOp *
+add_op(BenchTrace *trace, BenchOpType type)
+{
+	BenchOp    *op;
+
+	if (trace->nops == trace->maxops)
+	{
+		trace->maxops *= 2;
+		trace->ops = repalloc_huge(trace->ops, trace->maxops * sizeof(BenchOp));
+	}
+	op = &trace->ops[trace->nops++];
+	memset(op, 0, sizeof(BenchOp));
+	op->type = type;
+
+	return op;
+}
+
+static void
+add_file_op(BenchTrace *trace, BenchOpType type, const char *path, off_t size)
+{
+	BenchOp    *op = add_op(trace, type);
+
+	op->path = pstrdup(path);
+	op->size = size;
+	if (!isRelDataFile(path, &op->rnode))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("\"%s\" is not a relation data file", path)));
+}
+
+/*
+ * Read a trace file.
+ */
+static void
+read_trace(BenchTrace *trace, const char *filename)
+{
+	FILE	   *file;
+	char		line[MAXPGPATH + 64];
+	int			lineno = 0;
+
+	file = AllocateFile(filename, "r");
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open trace file \"%s\": %m", filename)));
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char		path[MAXPGPATH];
+		int64		size;
+		BenchOp    *op;
+		bool		ok;
+
+		lineno++;
+		switch (line[0])
+		{
+			case 'A':
+			case 'U':
+				ok = (sscanf(line + 1, "%1023s " INT64_FORMAT, path, &size) == 2);
+				if (ok)
+					add_file_op(trace,
+								line[0] == 'A' ? BENCH_OP_ADD : BENCH_OP_UPDATE,
+								path, size);
+				break;
+			case 'R':
+				ok = (sscanf(line + 1, "%1023s", path) == 1);
+				if (ok)
+					add_file_op(trace, BENCH_OP_REMOVE, path, 0);
+				break;
+			case 'O':
+				op = add_op(trace, BENCH_OP_OWNER);
+				ok = (sscanf(line + 1, "%u %u %u %u",
+							 &op->rnode.spcNode, &op->rnode.dbNode,
+							 &op->rnode.relNode, &op->owner) == 4);
+				break;
+			case 'G':
+				add_op(trace, BENCH_OP_GENERATION);
+				ok = true;
+				break;
+			case 'S':
+				add_op(trace, BENCH_OP_SWEEP);
+				ok = true;
+				break;
+			case '\n':
+			case '#':
+				ok = true;
+				break;
+			default:
+				ok = false;
+				break;
+		}
+		if (!ok)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid line %d in trace file \"%s\"",
+							lineno, filename)));
+	}
+
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read trace file \"%s\": %m", filename)));
+	FreeFile(file);
+}
+
+/*
+ * Path of segment 's' of synthetic relation 'r'.
+ */
+static void
+segment_path(char *path, int r, int s)
+{
+	if (s == 0)
+		snprintf(path, MAXPGPATH, "base/%u/%u",
+				 MyDatabaseId, SYNTHETIC_RELNODE_BASE + r);
+	else
+		snprintf(path, MAXPGPATH, "base/%u/%u.%d",
+				 MyDatabaseId, SYNTHETIC_RELNODE_BASE + r, s);
+}
+
+/*
+ * Generate a synthetic trace: an initial scan of 'relations' relations of
+ * 'segments' files each, owned by 'roles' roles, followed by 'cycles'
+ * rescans. Before each rescan, a 'churn' fraction of the relations is
+ * dropped, as many new ones are created, and as many files change size.
+ * Sizes are from 8 kB to 1 GB, like in scan_bench.sh.
+ */
+static void
+generate_trace(BenchTrace *trace, int relations, int segments, int roles,
+			   int cycles, double churn, int seed)
+{
+	unsigned short xseed[3];
+	int			nchurn = (int) (relations * churn);
+	int			maxrels = relations + cycles * nchurn;
+	int			nrels = 0;
+	int			firstnew;
+	bool	   *dropped;
+	off_t	   *sizes;
+	char		path[MAXPGPATH];
+	int			cycle;
+	int			r;
+	int			s;
+
+	xseed[0] = 0x330E;
+	xseed[1] = (unsigned short) seed;
+	xseed[2] = (unsigned short) (seed >> 16);
+
+	dropped = palloc0(maxrels * sizeof(bool));
+	sizes = palloc_extended((Size) maxrels * segments * sizeof(off_t),
+							MCXT_ALLOC_HUGE);
+
+#define RANDOM_SIZE() \
+	((off_t) BLCKSZ * (1 + (off_t) (pg_erand48(xseed) * 131071)))
+
+	for (cycle = 0; cycle <= cycles; cycle++)
+	{
+		if (cycle > 0)
+		{
+			add_op(trace, BENCH_OP_GENERATION);
+
+			/* Drop some relations, and resize some files */
+			for (r = 0; r < nrels; r++)
+			{
+				if (!dropped[r] && pg_erand48(xseed) < churn)
+					dropped[r] = true;
+			}
+			for (r = 0; r < nrels; r++)
+			{
+				if (dropped[r])
+					continue;
+				for (s = 0; s < segments; s++)
+				{
+					if (pg_erand48(xseed) < churn)
+						sizes[(Size) r * segments + s] = RANDOM_SIZE();
+					segment_path(path, r, s);
+					add_file_op(trace, BENCH_OP_UPDATE, path,
+								sizes[(Size) r * segments + s]);
+				}
+			}
+		}
+
+		/* Create new relations, all of them in the initial scan */
+		firstnew = nrels;
+		for (r = 0; r < (cycle == 0 ? relations : nchurn); r++)
+		{
+			for (s = 0; s < segments; s++)
+			{
+				sizes[(Size) nrels * segments + s] = RANDOM_SIZE();
+				segment_path(path, nrels, s);
+				add_file_op(trace, BENCH_OP_ADD, path,
+							sizes[(Size) nrels * segments + s]);
+			}
+			nrels++;
+		}
+
+		if (cycle > 0)
+			add_op(trace, BENCH_OP_SWEEP);
+
+		/* Look up the owners of the new relations */
+		for (r = firstnew; r < nrels; r++)
+		{
+			BenchOp    *op = add_op(trace, BENCH_OP_OWNER);
+
+			op->rnode.spcNode = DEFAULTTABLESPACE_OID;
+			op->rnode.dbNode = MyDatabaseId;
+			op->rnode.relNode = SYNTHETIC_RELNODE_BASE + r;
+			op->owner = FirstNormalObjectId + (Oid) (pg_erand48(xseed) * roles);
+		}
+	}
+
+#undef RANDOM_SIZE
+
+	pfree(dropped);
+	pfree(sizes);
+}
+
+/*
+ * Open a counter of the cache misses of this process, in user space.
+ * Returns -1 if not supported, or not allowed by perf_event_paranoid.
+ */
+static int
+open_cache_miss_counter(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static int64
+read_cache_misses(int fd)
+{
+	uint64		value;
+
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	return (int64) value;
+}
+
+/*
+ * Run one operation. Returns the number of operations it counts as.
+ */
+static int64
+run_op(BenchOp *op)
+{
+	FileSizeEntry *fsentry;
+	int64		nfiles;
+
+	switch (op->type)
+	{
+		case BENCH_OP_ADD:
+		case BENCH_OP_UPDATE:
+			UpdateFileSize(&op->rnode, op->path, op->size);
+			break;
+		case BENCH_OP_REMOVE:
+			fsentry = (FileSizeEntry *) hash_search(path_to_fsentry_map,
+													(void *) op->path,
+													HASH_FIND, NULL);
+			if (fsentry)
+				RemoveFileSize(fsentry);
+			break;
+		case BENCH_OP_OWNER:
+			UpdateRelOwner(&op->rnode, op->owner);
+			break;
+		case BENCH_OP_GENERATION:
+			generation++;
+			break;
+		case BENCH_OP_SWEEP:
+			nfiles = hash_get_num_entries(path_to_fsentry_map);
+			SweepRemovedFiles();
+			return nfiles;
+		case NUM_BENCH_OPS:
+			break;
+	}
+	return 1;
+}
+
+/*
+ * Replay the trace, timing each run of operations of the same kind.
+ */
+static void
+replay_trace(BenchTrace *trace, BenchResult *results, int counter_fd)
+{
+	int			i = 0;
+
+	while (i < trace->nops)
+	{
+		BenchOpType type = trace->ops[i].type;
+		BenchResult *result = &results[type];
+		instr_time	start;
+		instr_time	duration;
+		int64		misses;
+		int64		model_bytes;
+
+		misses = read_cache_misses(counter_fd);
+		INSTR_TIME_SET_CURRENT(start);
+
+		for (; i < trace->nops && trace->ops[i].type == type; i++)
+			result->count += run_op(&trace->ops[i]);
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		result->cache_misses += read_cache_misses(counter_fd) - misses;
+		result->seconds += INSTR_TIME_GET_DOUBLE(duration);
+
+		model_bytes = MemoryContextTotalSpace(FsModelContext);
+		result->peak_model_bytes = Max(result->peak_model_bytes, model_bytes);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * fs_model_bench(trace, relations, segments, roles, cycles, churn, seed)
+ *
+ * Replay 'trace', or a synthetic trace if it's NULL, and return ns/op,
+ * cache misses/op and the peak size of the model, for each kind of
+ * operation.
+ */
+Datum
+fs_model_bench(PG_FUNCTION_ARGS)
+{
+#define FS_MODEL_BENCH_COLS	5
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	MemoryContext tracecontext;
+	BenchTrace	trace;
+	BenchResult results[NUM_BENCH_OPS];
+	int			counter_fd;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3) ||
+		PG_ARGISNULL(4) || PG_ARGISNULL(5) || PG_ARGISNULL(6))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("only the trace file can be NULL")));
+
+	/* Keep the trace out of the model's memory */
+	tracecontext = AllocSetContextCreate(CurrentMemoryContext,
+										 "fs_model_bench trace",
+										 ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(tracecontext);
+
+	trace.nops = 0;
+	trace.maxops = 1024;
+	trace.ops = palloc(trace.maxops * sizeof(BenchOp));
+	if (!PG_ARGISNULL(0))
+		read_trace(&trace, text_to_cstring(PG_GETARG_TEXT_PP(0)));
+	else
+		generate_trace(&trace,
+					   PG_GETARG_INT32(1), PG_GETARG_INT32(2),
+					   Max(PG_GETARG_INT32(3), 1), PG_GETARG_INT32(4),
+					   PG_GETARG_FLOAT8(5), PG_GETARG_INT32(6));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Set up the model, like a worker does */
+	num_databases = 1;
+	max_quota_entries = 1024 * 1024;
+	pg_quota_shmem_startup();
+	init_fs_model(0);
+
+	memset(results, 0, sizeof(results));
+	counter_fd = open_cache_miss_counter();
+	if (counter_fd < 0)
+		ereport(NOTICE,
+				(errmsg("could not open cache miss counter: %m"),
+				 errhint("Check kernel.perf_event_paranoid.")));
+
+	replay_trace(&trace, results, counter_fd);
+
+	if (counter_fd >= 0)
+		close(counter_fd);
+	MemoryContextDelete(tracecontext);
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < NUM_BENCH_OPS; i++)
+	{
+		BenchResult *result = &results[i];
+		Datum		values[FS_MODEL_BENCH_COLS];
+		bool		nulls[FS_MODEL_BENCH_COLS];
+
+		if (result->count == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(bench_op_names[i]);
+		values[1] = Int64GetDatum(result->count);
+		values[2] = Float8GetDatum(result->seconds * 1000000000.0 / result->count);
+		if (counter_fd >= 0)
+			values[3] = Float8GetDatum((double) result->cache_misses / result->count);
+		else
+			nulls[3] = true;
+		values[4] = Int64GetDatum(result->peak_model_bytes);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# model_bench.sh
+#	Microbenchmark of the fs_model data structures.
+#
+# Replays a trace of file observations and owner lookups through the
+# model's functions, in a single-user backend of a scratch cluster, with the
+# module built from bench/fs_model_bench.c. Nothing else runs in the
+# cluster, and there's no I/O, so the numbers are for the hash tables, the
+# orphan list and the sweep alone. See fs_model_bench.c for the trace
+# format, and record_trace.sh to record one from a live data directory.
+#
+# Prints one JSON object per kind of operation on stdout: how many there
+# were, ns/op, cache misses/op (null if perf events are not available,
+# see kernel.perf_event_paranoid), and the peak memory used by the model.
+# Sweeps count the files visited, not the sweeps.
+#
+# The module must be built first, with "make -C bench".
+#
+# Environment variables:
+#   TRACE          trace file to replay; if not set, a synthetic trace is
+#                  generated with the settings below
+#   RELATIONS      relations in the initial scan (default 50000)
+#   SEGMENTS       files per relation (default 2)
+#   ROLES          owners of the relations (default 100)
+#   CYCLES         rescans after the initial scan (default 5)
+#   CHURN          fraction of relations dropped and created, and of files
+#                  resized, before each rescan (default 0.01)
+#   SEED           random seed (default 1)
+#   BENCH_DIR      scratch directory (default ./bench_data)
+
+set -e
+
+RELATIONS=${RELATIONS:-50000}
+SEGMENTS=${SEGMENTS:-2}
+ROLES=${ROLES:-100}
+CYCLES=${CYCLES:-5}
+CHURN=${CHURN:-0.01}
+SEED=${SEED:-1}
+BENCH_DIR=${BENCH_DIR:-$(pwd)/bench_data}
+
+BINDIR=$(${PG_CONFIG:-pg_config} --bindir)
+PGDATA=$BENCH_DIR/data
+MODULE=$(cd "$(dirname "$0")" && pwd)/fs_model_bench.so
+
+if [ ! -f "$MODULE" ]; then
+	echo "$MODULE not found, run \"make -C bench\" first" >&2
+	exit 1
+fi
+
+if [ -n "$TRACE" ]; then
+	TRACE_ARG="'$(cd "$(dirname "$TRACE")" && pwd)/$(basename "$TRACE")'"
+else
+	TRACE_ARG=NULL
+fi
+
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR"
+"$BINDIR/initdb" -D "$PGDATA" -A trust >/dev/null
+
+# In single-user mode, each line is a statement. The results are printed as
+# '1: result = "<json>"  (typeid = ...)'.
+"$BINDIR/postgres" --single -D "$PGDATA" postgres 2>"$BENCH_DIR/postgres.log" <<SQL |
+CREATE FUNCTION fs_model_bench(trace text, relations int4, segments int4, roles int4, cycles int4, churn float8, seed int4, op OUT text, count OUT int8, ns_per_op OUT float8, cache_misses_per_op OUT float8, peak_model_bytes OUT int8) RETURNS SETOF record AS '$MODULE', 'fs_model_bench' LANGUAGE C
+SELECT row_to_json(r)::text AS result FROM (SELECT $TRACE_ARG::text AS trace, $RELATIONS AS relations, $SEGMENTS AS segments, $ROLES AS roles, $CYCLES AS cycles, $CHURN AS churn, $SEED AS seed, b.* FROM fs_model_bench($TRACE_ARG, $RELATIONS, $SEGMENTS, $ROLES, $CYCLES, $CHURN, $SEED) b) r
+SQL
+	sed -n 's/^[[:space:]]*[0-9]*: result = "\(.*\)"[[:space:]]*(typeid.*$/\1/p'
+
+rm -rf "$BENCH_DIR"
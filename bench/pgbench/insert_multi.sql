@@ -0,0 +1,7 @@
+-- One statement inserting into four tables. The permission hook checks
+-- the quota for each of them.
+\set id random(1, 1000000000)
+WITH a AS (INSERT INTO bench_multi1 VALUES (:id, 'x')),
+     b AS (INSERT INTO bench_multi2 VALUES (:id, 'x')),
+     c AS (INSERT INTO bench_multi3 VALUES (:id, 'x'))
+INSERT INTO bench_multi4 VALUES (:id, 'x');
@@ -0,0 +1,3 @@
+-- Single-row INSERT into a plain table.
+\set id random(1, 1000000000)
+INSERT INTO bench_single VALUES (:id, 'x');
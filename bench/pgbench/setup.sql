@@ -0,0 +1,22 @@
+-- Tables for the enforcement benchmark. They're owned by a role with a
+-- quota that is never reached, so that every INSERT does the full check.
+CREATE ROLE bench_owner NOLOGIN;
+CREATE SCHEMA bench AUTHORIZATION bench_owner;
+SET search_path = bench;
+
+CREATE TABLE bench_single (id int4, t text);
+CREATE TABLE bench_multi1 (id int4, t text);
+CREATE TABLE bench_multi2 (id int4, t text);
+CREATE TABLE bench_multi3 (id int4, t text);
+CREATE TABLE bench_multi4 (id int4, t text);
+CREATE TABLE bench_copy (id int4, t text);
+
+CREATE TABLE bench_part (id int4, t text) PARTITION BY HASH (id);
+SELECT format('CREATE TABLE bench_part_%s PARTITION OF bench_part FOR VALUES WITH (MODULUS 16, REMAINDER %s)', i, i)
+FROM generate_series(0, 15) i \gexec
+
+SELECT format('ALTER TABLE %I OWNER TO bench_owner', relname)
+FROM pg_class WHERE relnamespace = 'bench'::regnamespace AND relkind IN ('r', 'p') \gexec
+
+INSERT INTO quota.config VALUES ('bench_owner'::regrole, pg_size_bytes('1 PB'));
+INSERT INTO quota.schema_config VALUES ('bench'::regnamespace, pg_size_bytes('1 PB'));
@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# record_trace.sh
+#	Record a trace of a live data directory, for model_bench.sh.
+#
+# Lists the relation files of a database COUNT times, INTERVAL seconds
+# apart, like the worker's scans would see them, and writes them to stdout
+# as a trace: each listing is a scan, followed by the owners of the
+# relations that are new, or have a new owner, from pg_class. Run it as the
+# server's OS user, with PGDATA set, and the connection settings for the
+# database in the usual libpq environment variables.
+#
+# Environment variables:
+#   COUNT          number of listings (default 3)
+#   INTERVAL       seconds between them (default 10)
+
+set -e
+
+COUNT=${COUNT:-3}
+INTERVAL=${INTERVAL:-10}
+
+if [ -z "$PGDATA" ]; then
+	echo "PGDATA is not set" >&2
+	exit 1
+fi
+
+psql_cmd() {
+	psql -X -A -t -q -F ' ' -c "$1"
+}
+
+DBOID=$(psql_cmd "SELECT oid FROM pg_database WHERE datname = current_database()")
+
+# Relation files of the database, as "F <path> <size>", with the same
+# paths as the worker's.
+list_files() {
+	(cd "$PGDATA" &&
+	 find -H base/"$DBOID" pg_tblspc/*/*/"$DBOID" -maxdepth 1 -type f \
+		-regex '.*/[0-9]+\(_[a-z]+\)?\(\.[0-9]+\)?' \
+		-printf 'F %p %s\n' 2>/dev/null || true)
+}
+
+# Owners, as "O <spc> <db> <rel> <owner>"
+list_owners() {
+	psql_cmd "SELECT 'O', COALESCE(NULLIF(c.reltablespace, 0), d.dattablespace),
+	                 d.oid, pg_relation_filenode(c.oid), c.relowner
+	          FROM pg_class c, pg_database d
+	          WHERE d.oid = $DBOID AND pg_relation_filenode(c.oid) IS NOT NULL"
+}
+
+for i in $(seq 1 "$COUNT"); do
+	if [ "$i" -gt 1 ]; then
+		sleep "$INTERVAL"
+		echo "G"
+	fi
+	list_files
+	if [ "$i" -gt 1 ]; then
+		echo "S"
+	fi
+	list_owners
+done | awk '
+	# Files seen before are updates, the rest are adds. Files not seen in
+	# a scan are removed by the sweep.
+	$1 == "G" { scan++; print; next }
+	$1 == "S" {
+		for (path in seen)
+			if (seen[path] != scan)
+				delete seen[path]
+		print
+		next
+	}
+	$1 == "F" {
+		print ($2 in seen ? "U" : "A"), $2, $3
+		seen[$2] = scan
+		next
+	}
+	# Only owners that are new or changed are looked up again
+	$1 == "O" {
+		key = $2 " " $3 " " $4
+		if (owner[key] != $5) {
+			owner[key] = $5
+			print
+		}
+	}'
@@ -0,0 +1,194 @@
+#!/bin/bash
+#
+# scan_bench.sh
+#	Benchmark the pg_quota data directory scanner on synthetic data.
+#
+# Creates a scratch cluster with pg_quota loaded, fills the database
+# directory and a few tablespaces with fake relation segments, and measures
+# the worker's scan cycles, with some churn (new, extended and removed
+# segments) applied before each cycle. The fake segments have no pg_class
+# entries, so they also exercise the orphan lookups.
+#
+# Prints one JSON object per measured cycle on stdout. Cycle 0 is the
+# initial scan, which builds the model from scratch.
+#
+# The extension must be installed first, with "make install".
+#
+# Environment variables:
+#   SIZES          number of segments to test with (default "10000 100000 1000000")
+#   TABLESPACES    number of tablespaces besides pg_default (default 2)
+#   CYCLES         number of cycles to measure for each size (default 5)
+#   CHURN_CREATE   segments to create before each cycle (default 1000)
+#   CHURN_EXTEND   segments to extend before each cycle (default 1000)
+#   CHURN_DROP     segments to remove before each cycle (default 1000)
+#   NAPTIME        pg_quota.refresh_naptime, in seconds (default 5); must be
+#                  long enough to apply the churn while the worker sleeps
+#   BENCH_DIR      scratch directory (default ./bench_data)
+#   BENCH_PORT     port of the scratch cluster (default 54329)
+
+set -e
+
+SIZES=${SIZES:-"10000 100000 1000000"}
+TABLESPACES=${TABLESPACES:-2}
+CYCLES=${CYCLES:-5}
+CHURN_CREATE=${CHURN_CREATE:-1000}
+CHURN_EXTEND=${CHURN_EXTEND:-1000}
+CHURN_DROP=${CHURN_DROP:-1000}
+NAPTIME=${NAPTIME:-5}
+BENCH_DIR=${BENCH_DIR:-$(pwd)/bench_data}
+BENCH_PORT=${BENCH_PORT:-54329}
+
+BINDIR=$(${PG_CONFIG:-pg_config} --bindir)
+PGDATA=$BENCH_DIR/data
+LOG=$BENCH_DIR/postmaster.log
+
+psql_cmd() {
+	"$BINDIR/psql" -X -A -t -q -p "$BENCH_PORT" -h "$BENCH_DIR" -d postgres -c "$1"
+}
+
+start_cluster() {
+	"$BINDIR/pg_ctl" -D "$PGDATA" -l "$LOG" -w -o "-p $BENCH_PORT -k $BENCH_DIR" start >/dev/null
+}
+
+stop_cluster() {
+	"$BINDIR/pg_ctl" -D "$PGDATA" -m fast -w stop >/dev/null
+}
+
+trap 'stop_cluster 2>/dev/null || true' EXIT
+
+# The directories to spread the fake segments over: the database directory
+# in pg_default, and in each tablespace.
+segment_dirs() {
+	local dboid=$1
+	echo "$PGDATA/base/$dboid"
+	for ts in "$PGDATA"/pg_tblspc/*; do
+		[ -d "$ts" ] || continue
+		echo "$(echo "$ts"/PG_*)/$dboid"
+	done
+}
+
+# Wait until the worker has completed more than $1 cycles, and print the
+# new cycle count.
+wait_for_cycle() {
+	local after=$1
+	local cycles
+	while true; do
+		cycles=$(psql_cmd "SELECT cycles FROM quota.scan_stats")
+		if [ -n "$cycles" ] && [ "$cycles" -gt "$after" ]; then
+			echo "$cycles"
+			return
+		fi
+		sleep 0.1
+	done
+}
+
+report_cycle() {
+	local nsegments=$1
+	local cycle=$2
+	local row pid rss
+
+	row=$(psql_cmd "SELECT pid, cycle_time, scan_time, sweep_time, orphans_time,
+	                       dirs_scanned, stat_calls, files, relations, orphans,
+	                       model_bytes
+	                FROM quota.scan_stats")
+	IFS='|' read -r pid cycle_ms scan_ms sweep_ms orphans_ms dirs stats files rels orphans model <<< "$row"
+	rss=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status" 2>/dev/null || echo null)
+
+	printf '{"segments": %d, "tablespaces": %d, "cycle": %d, "cycle_ms": %s, "scan_ms": %s, "sweep_ms": %s, "orphans_ms": %s, "dirs_scanned": %s, "stat_calls": %s, "files": %s, "relations": %s, "orphans": %s, "model_bytes": %s, "rss_kb": %s}\n' \
+		"$nsegments" "$TABLESPACES" "$cycle" "$cycle_ms" "$scan_ms" "$sweep_ms" \
+		"$orphans_ms" "$dirs" "$stats" "$files" "$rels" "$orphans" "$model" "${rss:-null}"
+}
+
+# Set up the scratch cluster.
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR"
+"$BINDIR/initdb" -D "$PGDATA" -A trust >/dev/null
+cat >> "$PGDATA/postgresql.conf" <<CONF
+shared_preload_libraries = 'pg_quota'
+pg_quota.databases = 'postgres'
+pg_quota.refresh_naptime = '$NAPTIME s'
+CONF
+
+start_cluster
+psql_cmd "CREATE EXTENSION pg_quota"
+for i in $(seq 1 "$TABLESPACES"); do
+	mkdir -p "$BENCH_DIR/ts$i"
+	psql_cmd "CREATE TABLESPACE bench_ts$i LOCATION '$BENCH_DIR/ts$i'"
+done
+DBOID=$(psql_cmd "SELECT oid FROM pg_database WHERE datname = 'postgres'")
+stop_cluster
+
+for nsegments in $SIZES; do
+	# Fill the directories with fake segments. Relfilenodes are allocated
+	# from a range that the real ones won't reach. Files are sparse, with
+	# sizes from 8 kB to 1 GB.
+	segment_dirs "$DBOID" | perl -e '
+		my $n = shift;
+		my @dirs = <STDIN>;
+		chomp @dirs;
+		foreach my $dir (@dirs) {
+			mkdir $dir;
+			opendir(my $dh, $dir) or die;
+			unlink map { "$dir/$_" } grep { /^[0-9]{10}/ } readdir($dh);
+			closedir($dh);
+		}
+		for (my $i = 0; $i < $n; $i++) {
+			my $dir = $dirs[$i % scalar(@dirs)];
+			my $path = sprintf("%s/%u", $dir, 2000000000 + $i);
+			open(my $fh, ">", $path) or die "could not create $path: $!";
+			truncate($fh, 8192 * (1 + int(rand(131072)))) or die;
+			close($fh);
+		}' "$nsegments"
+	echo $((2000000000 + nsegments)) > "$BENCH_DIR/next_relfilenode"
+
+	start_cluster
+
+	# Cycle 0: initial scan, building the model from scratch.
+	cycles=$(wait_for_cycle 0)
+	report_cycle "$nsegments" 0
+
+	for cycle in $(seq 1 "$CYCLES"); do
+		# The worker is now sleeping for refresh_naptime. Apply the churn,
+		# so that the next cycle sees all of it.
+		segment_dirs "$DBOID" | perl -e '
+			my ($create, $extend, $drop, $nextfile) = @ARGV;
+			my @dirs = <STDIN>;
+			chomp @dirs;
+			open(my $nf, "<", $nextfile) or die;
+			my $next = <$nf>;
+			chomp $next;
+			close($nf);
+
+			my @files;
+			foreach my $dir (@dirs) {
+				opendir(my $dh, $dir) or die;
+				push @files, map { "$dir/$_" } grep { /^[0-9]{10}/ } readdir($dh);
+				closedir($dh);
+			}
+			for (my $i = 0; $i < $extend && @files; $i++) {
+				my $path = $files[int(rand(scalar(@files)))];
+				truncate($path, (-s $path) + 8192 * (1 + int(rand(128))));
+			}
+			for (my $i = 0; $i < $drop && @files; $i++) {
+				my $j = int(rand(scalar(@files)));
+				unlink($files[$j]);
+				splice(@files, $j, 1);
+			}
+			for (my $i = 0; $i < $create; $i++) {
+				my $path = sprintf("%s/%u", $dirs[$i % scalar(@dirs)], $next++);
+				open(my $fh, ">", $path) or die "could not create $path: $!";
+				truncate($fh, 8192 * (1 + int(rand(131072))));
+				close($fh);
+			}
+
+			open($nf, ">", $nextfile) or die;
+			print $nf "$next\n";
+			close($nf);' "$CHURN_CREATE" "$CHURN_EXTEND" "$CHURN_DROP" "$BENCH_DIR/next_relfilenode"
+
+		# The next cycle starts after the churn. Report it once it's done.
+		cycles=$(wait_for_cycle "$cycles")
+		report_cycle "$nsegments" "$cycle"
+	done
+
+	stop_cluster
+done
@@ -6,40 +6,117 @@
  * This file contains functions for enforcing quotas. Currently, they are
  * only enforced for INSERTS and COPY, by using the ExecCheckRTPerms hook.
  *
+ * Optionally, statements are also throttled as the owner of the relation
+ * approaches its quota, by sleeping for a while in the same hook. That's
+ * once per statement, so it only slows down workloads of many small
+ * statements; there is no hook to sleep every N rows within a COPY.
+ *
+ * The limits on the number of relations and files a role can own are
+ * enforced in the ProcessUtility hook, when creating tables and indexes.
+ *
  * Copyright (c) 2013-2018, PostgreSQL Global Development Group
  * -------------------------------------------------------------------------
  */
 #include "postgres.h"
 
 #include "access/htup_details.h"
+#include "catalog/namespace.h"
 #include "catalog/pg_class.h"
+#include "commands/dbcommands.h"
+#include "commands/tablespace.h"
 #include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/utility.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 #include "pg_quota.h"
 
 static bool quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation);
+static void quota_check_ProcessUtility(PlannedStmt *pstmt,
+						   const char *queryString,
+						   ProcessUtilityContext context,
+						   ParamListInfo params,
+						   QueryEnvironment *queryEnv,
+						   DestReceiver *dest, char *completionTag);
 
 static ExecutorCheckPerms_hook_type prev_ExecutorCheckPerms_hook;
 static bool ExecutorCheckPerms_hook_installed = false;
+static ProcessUtility_hook_type prev_ProcessUtility_hook;
+
+/* GUC variables */
+static int	pg_quota_throttle_threshold = 0;
+static int	pg_quota_throttle_max_delay = 1000;
+static bool pg_quota_free_space_headroom = false;
 
 /*
- * Initialize enforcement, by installing the executor permission hook.
+ * Initialize enforcement, by defining the throttling GUCs and installing the
+ * executor permission and utility hooks.
  */
 void
 init_quota_enforcement(void)
 {
+	DefineCustomIntVariable("pg_quota.throttle_threshold",
+							"Percentage of a role's quota at which writes start to be delayed.",
+							"0 disables throttling.",
+							&pg_quota_throttle_threshold,
+							0,
+							0,
+							100,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.throttle_max_delay",
+							"Longest delay added to a statement by throttling.",
+							NULL,
+							&pg_quota_throttle_max_delay,
+							1000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_quota.free_space_headroom",
+							 "Don't count the free space recorded in the free space map of a table against its owner's quota, when inserting into it.",
+							 NULL,
+							 &pg_quota_free_space_headroom,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	if (!ExecutorCheckPerms_hook_installed)
 	{
 		prev_ExecutorCheckPerms_hook = ExecutorCheckPerms_hook;
 		ExecutorCheckPerms_hook = quota_check_ExecCheckRTPerms;
+		prev_ProcessUtility_hook = ProcessUtility_hook;
+		ProcessUtility_hook = quota_check_ProcessUtility;
+		ExecutorCheckPerms_hook_installed = true;
 
 		elog(DEBUG1, "disk quota permissions hook installed");
 	}
 }
 
-static Oid
-get_rel_owner(Oid relid)
+/*
+ * Look up the owner, schema and tablespace of a relation. These are the
+ * objects whose quotas apply to it.
+ */
+static bool
+get_rel_quota_objects(Oid relid, Oid *owner, Oid *nspid, Oid *spcid)
 {
 	HeapTuple	tp;
 
@@ -47,37 +124,88 @@ get_rel_owner(Oid relid)
 	if (HeapTupleIsValid(tp))
 	{
 		Form_pg_class reltup = (Form_pg_class) GETSTRUCT(tp);
-		Oid			result;
 
-		result = reltup->relowner;
+		*owner = reltup->relowner;
+		*nspid = reltup->relnamespace;
+		*spcid = reltup->reltablespace;
+		if (!OidIsValid(*spcid))
+			*spcid = MyDatabaseTableSpace;
 		ReleaseSysCache(tp);
-		return result;
+		return true;
 	}
 	else
 	{
 		elog(DEBUG1, "could not find owner for relation %u", relid);
-		return InvalidOid;
+		return false;
+	}
+}
+
+/*
+ * Sleep for 'delay' milliseconds, to throttle a statement. The sleep can be
+ * interrupted by query cancel.
+ */
+static void
+throttle_sleep(long delay)
+{
+	TimestampTz end = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), delay);
+
+	for (;;)
+	{
+		long		secs;
+		int			usecs;
+		long		remaining;
+		int			rc;
+
+		TimestampDifference(GetCurrentTimestamp(), end, &secs, &usecs);
+		remaining = secs * 1000 + usecs / 1000;
+		if (remaining <= 0)
+			break;
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   remaining,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
 	}
 }
 
 /*
  * Permission check hook function. Throws an error if you try to INSERT
  * (or COPY) into a table, and the quota has been exceeded.
+ *
+ * If the owner of the table is close to its quota, and throttling is
+ * enabled, delays the statement instead. If the statement writes to several
+ * tables, it's delayed once, by the longest delay of any of them.
  */
 static bool
 quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation)
 {
 	ListCell   *l;
+	long		delay = 0;
 
 	foreach(l, rangeTable)
 	{
 		RangeTblEntry *rte = (RangeTblEntry *) lfirst(l);
 		Oid			owner;
+		Oid			nspid;
+		Oid			spcid;
+		QuotaKind	violated;
 
 		/* see ExecCheckRTEPerms() */
 		if (rte->rtekind != RTE_RELATION)
 			continue;
 
+		if ((rte->requiredPerms & (ACL_INSERT | ACL_UPDATE | ACL_DELETE)) == 0)
+			continue;
+
+		/* The worker may have stopped scanning, if nothing was written */
+		WakeIdleWorker();
+
 		/*
 		 * Only check quota on inserts. UPDATEs may well increase
 		 * space usage too, but we ignore that for now.
@@ -87,26 +215,175 @@ quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation)
 
 		/*
 		 * Perform the check as the relation's owner, rather than the current
-		 * user.
+		 * user. The relation's schema and tablespace can have quotas, too.
 		 */
-		owner = get_rel_owner(rte->relid);
-		if (owner == InvalidOid)
+		if (!get_rel_quota_objects(rte->relid, &owner, &nspid, &spcid))
 			return true; /* no owner, huh? */
 
-		if (!CheckQuota(owner))
+		if (!CheckQuota(owner, nspid, spcid,
+						pg_quota_free_space_headroom ? rte->relid : InvalidOid,
+						&violated))
 		{
 			/*
-			 * The owner is out of quota. Report error.
-			 *
-			 * We
+			 * The owner, schema or tablespace is out of quota. Report error.
 			 */
 			if (ereport_on_violation)
-				ereport(ERROR,
-						(errcode(ERRCODE_DISK_FULL),
-						 errmsg("user's disk space quota exceeded")));
+			{
+				switch (violated)
+				{
+					case QUOTA_ROLE:
+						ereport(ERROR,
+								(errcode(ERRCODE_DISK_FULL),
+								 errmsg("user's disk space quota exceeded")));
+						break;
+					case QUOTA_GROUP:
+						ereport(ERROR,
+								(errcode(ERRCODE_DISK_FULL),
+								 errmsg("group's disk space quota exceeded")));
+						break;
+					case QUOTA_CLUSTER:
+						ereport(ERROR,
+								(errcode(ERRCODE_DISK_FULL),
+								 errmsg("user's cluster-wide disk space quota exceeded")));
+						break;
+					case QUOTA_NAMESPACE:
+						ereport(ERROR,
+								(errcode(ERRCODE_DISK_FULL),
+								 errmsg("disk space quota of schema \"%s\" exceeded",
+										get_namespace_name(nspid))));
+						break;
+					case QUOTA_TABLESPACE:
+						ereport(ERROR,
+								(errcode(ERRCODE_DISK_FULL),
+								 errmsg("disk space quota of tablespace \"%s\" exceeded",
+										get_tablespace_name(spcid))));
+						break;
+					case QUOTA_DATABASE:
+						ereport(ERROR,
+								(errcode(ERRCODE_DISK_FULL),
+								 errmsg("disk space quota of database \"%s\" exceeded",
+										get_database_name(MyDatabaseId))));
+						break;
+				}
+			}
 			return false;
 		}
+
+		if (pg_quota_throttle_threshold > 0 && ereport_on_violation)
+			delay = Max(delay, GetThrottleDelay(owner,
+												pg_quota_throttle_threshold,
+												pg_quota_throttle_max_delay));
+	}
+
+	if (delay > 0)
+	{
+		elog(DEBUG1, "throttling statement for %ld ms, owner is close to disk space quota",
+			 delay);
+		throttle_sleep(delay);
 	}
 
 	return true;
 }
+
+/*
+ * Throw an error if 'owner' has reached its limit on the number of relations
+ * or files.
+ */
+static void
+check_count_quota(Oid owner)
+{
+	bool		files;
+
+	if (!CheckCountQuota(owner, &files))
+	{
+		if (files)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 errmsg("user's file count quota exceeded")));
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 errmsg("user's relation count quota exceeded")));
+	}
+}
+
+/*
+ * Utility hook function. Throws an error if you try to create a table or
+ * index, or attach a partition, and the owner of the new relations has
+ * reached its limit on the number of relations or files.
+ *
+ * Like the space quotas, this is checked at the beginning of the statement,
+ * so one statement can go over the limit by the number of relations it
+ * creates.
+ */
+static void
+quota_check_ProcessUtility(PlannedStmt *pstmt,
+						   const char *queryString,
+						   ProcessUtilityContext context,
+						   ParamListInfo params,
+						   QueryEnvironment *queryEnv,
+						   DestReceiver *dest, char *completionTag)
+{
+	Node	   *parsetree = pstmt->utilityStmt;
+	Oid			relid;
+	Oid			owner;
+	Oid			nspid;
+	Oid			spcid;
+
+	switch (nodeTag(parsetree))
+	{
+		case T_CreateStmt:
+		case T_CreateTableAsStmt:
+			/* New tables are owned by the current user */
+			check_count_quota(GetUserId());
+			break;
+
+		case T_IndexStmt:
+			/* An index is owned by the owner of its table */
+			relid = RangeVarGetRelid(((IndexStmt *) parsetree)->relation,
+									 NoLock, true);
+			if (OidIsValid(relid) &&
+				get_rel_quota_objects(relid, &owner, &nspid, &spcid))
+				check_count_quota(owner);
+			break;
+
+		case T_AlterTableStmt:
+			{
+				AlterTableStmt *atstmt = (AlterTableStmt *) parsetree;
+				ListCell   *lc;
+
+				/*
+				 * Attaching a partition creates the partitioned table's
+				 * indexes on it, owned by the owner of the partition.
+				 */
+				foreach(lc, atstmt->cmds)
+				{
+					AlterTableCmd *cmd = (AlterTableCmd *) lfirst(lc);
+
+					if (cmd->subtype == AT_AttachPartition)
+					{
+						PartitionCmd *pcmd = (PartitionCmd *) cmd->def;
+
+						relid = RangeVarGetRelid(pcmd->name, NoLock, true);
+						if (OidIsValid(relid) &&
+							get_rel_quota_objects(relid, &owner, &nspid, &spcid))
+							check_count_quota(owner);
+					}
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	if (prev_ProcessUtility_hook)
+		prev_ProcessUtility_hook(pstmt, queryString, context, params,
+								 queryEnv, dest, completionTag);
+	else
+		standard_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, completionTag);
+
+	/* Tell the worker about any relfilenodes the statement created */
+	RegisterRewrittenRelations(parsetree);
+}
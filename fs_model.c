@@ -8,67 +8,402 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "access/heapam.h"
+#include "access/htup_details.h"
 #include "access/transam.h"
+#include "access/xlog.h"
 #include "catalog/pg_tablespace_d.h"
+#include "commands/async.h"
+#include "commands/dbcommands.h"
+#include "commands/tablespace.h"
+#include "common/relpath.h"
 #include "fmgr.h"
 #include "funcapi.h"
 #include "lib/ilist.h"
+#include "lib/stringinfo.h"
 #include "miscadmin.h"
 #include "nodes/execnodes.h"
+#include "nodes/pg_list.h"
+#include "pgstat.h"
+#include "portability/instr_time.h"
+#include "storage/bufmgr.h"
+#include "storage/condition_variable.h"
 #include "storage/fd.h"
+#include "storage/fsm_internals.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
 #include "storage/relfilenode.h"
 #include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/dsa.h"
 #include "utils/hsearch.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
 
 #include "pg_quota.h"
 
-#define MAX_DB_ROLE_ENTRIES 1024
+/* Max number of relfilenodes registered by backends, but not yet seen */
+#define MAX_PENDING_RELFILENODES 8192
+
+/* How often to publish the progress of a scan, in files */
+#define PROGRESS_REPORT_INTERVAL 1024
+
+/* Free space map layout, as in freespace.c */
+#define FSM_CATEGORIES	256
+#define FSM_CAT_STEP	(BLCKSZ / FSM_CATEGORIES)
+#define FSM_TREE_DEPTH	((SlotsPerFSMPage >= 1626) ? 3 : 4)
+
+/*
+ * Time constant of the growth rate estimate, and the horizon used in the
+ * throttling delay, in seconds.
+ */
+#define GROWTH_RATE_WINDOW	60.0
+
+/*
+ * How far, in percentage points, usage must fall below a notification
+ * threshold before it's considered crossed downwards.
+ */
+#define NOTIFY_HYSTERESIS	5
+
+/* Number of usage samples kept for each role, one per scan */
+#define USAGE_HISTORY_SIZE	64
+
+/* Forecasts further out than this, in seconds, are not shown */
+#define FORECAST_HORIZON	(100.0 * SECS_PER_YEAR)
 
 PG_FUNCTION_INFO_V1(get_quota_status);
+PG_FUNCTION_INFO_V1(get_quota_totals);
+PG_FUNCTION_INFO_V1(get_relation_sizes);
+PG_FUNCTION_INFO_V1(get_scan_stats);
+PG_FUNCTION_INFO_V1(get_scan_progress);
+PG_FUNCTION_INFO_V1(get_usage_history);
+PG_FUNCTION_INFO_V1(get_usage_forecast);
+PG_FUNCTION_INFO_V1(verify_model);
 
 typedef struct FileSizeEntry FileSizeEntry;
 typedef struct RelSizeEntry RelSizeEntry;
-typedef struct RoleSizeEntry RoleSizeEntry;
-typedef struct RoleSizeEntryKey RoleSizeEntryKey;
+typedef struct QuotaEntry QuotaEntry;
+typedef struct QuotaEntryKey QuotaEntryKey;
+typedef struct TempUsageEntry TempUsageEntry;
+typedef struct RelationSizeEntry RelationSizeEntry;
+typedef struct RoleGroupsEntry RoleGroupsEntry;
+
+/* A role's usage at the end of one scan, see UpdateUsageHistory() */
+typedef struct UsageSample
+{
+	TimestampTz time;
+	int64		size;
+} UsageSample;
+
+/*
+ * Ring of a role's samples, in the DSA area. 'next' is the slot that the
+ * next sample goes to.
+ */
+typedef struct UsageHistory
+{
+	int			next;
+	int			count;
+	UsageSample samples[USAGE_HISTORY_SIZE];
+} UsageHistory;
 
 /*
  * Shared memory structure.
  *
- * In shared memory, we keep a hash table of RoleSizeEntrys. It's keyed by
- * role and database OID, and protected by shared->lock. It holds the
- * current total disk space usage, and quota, for each role and database.
+ * In shared memory, we keep a hash table of QuotaEntrys. It's keyed by
+ * the kind of object (role, group, schema, tablespace or database), its OID
+ * and the database OID, and protected by shared->lock. It holds the current total
+ * disk space usage, and quota, for each object and database.
+ *
+ * The total of a group is the sum of the totals of all its members. To keep
+ * the quota check cheap, each role's entry has a flag that says whether any
+ * of the groups it belongs to is over its quota.
+ *
+ * For cluster-wide role quotas, there is an additional entry for each role
+ * with InvalidOid as the database OID. Every worker adds the changes in its
+ * database to it, so it holds the role's total across all databases.
  */
-struct RoleSizeEntryKey
+struct QuotaEntryKey
 {
-	/* hash key consists of role and database OID */
-	Oid			rolid;
+	/* hash key consists of object kind and OID, and database OID */
+	QuotaKind	kind;
+	Oid			objid;
 	Oid			dbid;
 };
 
-struct RoleSizeEntry
+struct QuotaEntry
 {
-	RoleSizeEntryKey key;
+	QuotaEntryKey key;
 
 	off_t		totalsize;	/* current total space usage */
 	int64		quota;		/* quota from config table, or -1 for no quota */
+
+	off_t		temp_used;	/* space used by temporary files (roles only) */
+	int64		temp_quota;	/* temp file quota, or -1 for no quota */
+
+	/* Number of relfilenodes and segment files owned (roles only) */
+	int64		nrelations;
+	int64		nfiles;
+	int64		max_relations;	/* limits, or -1 for no limit */
+	int64		max_files;
+
+	bool		group_exceeded;	/* is a group of this role over quota? */
+
+	/*
+	 * Cluster-wide quota of the role, as configured in this database. The
+	 * quota in effect, in the cluster-wide entry, is the smallest of these.
+	 */
+	int64		cluster_quota;
+
+	int			quota_generation;	/* config load that last set the quotas */
+	int			cluster_quota_generation;	/* same, for cluster_quota */
+
+	int			notified_threshold;	/* highest threshold crossed, in %, or 0 */
+
+	dlist_node	db_node;		/* in the database's list of entries */
+
+	/*
+	 * Estimate of how fast the total is growing, in bytes per second (roles
+	 * only). It's a moving average, updated at the end of each scan from the
+	 * change in totalsize since the previous scan.
+	 */
+	double		growth_rate;
+	off_t		rate_size;		/* totalsize at the previous update */
+	TimestampTz rate_time;		/* time of the previous update */
+
+	/*
+	 * Ring of totalsize samples, taken at the end of each scan, for
+	 * quota.usage_history() and quota.forecast. Only role entries have one,
+	 * so it's allocated in the DSA area when the first sample is taken,
+	 * rather than kept in every entry.
+	 */
+	dsa_pointer history;		/* UsageHistory, or InvalidDsaPointer */
+
+	/*
+	 * Space in the role's relations that VACUUM has freed, or would free
+	 * (roles only), see UpdateReclaimableSpace(). free_space is the part
+	 * that's recorded in the free space maps of the tables themselves
+	 * already, where new rows can go.
+	 */
+	int64		reclaimable;
+	int64		free_space;
+};
+
+static HTAB *quota_totals_map;
+
+/*
+ * Relfilenodes registered by the backends that created them, with the owner
+ * and the other information that UpdateOrphans() would otherwise look up in
+ * pg_class. The creating transaction hasn't necessarily committed, so the
+ * worker couldn't find them in pg_class yet. Entries are removed when the
+ * worker picks them up, or after two scans if it never sees the files,
+ * like when the creating transaction aborted.
+ *
+ * The map has a lock of its own, shared->pending_lock, so that the worker
+ * going through its orphans doesn't hold up the backends' quota checks.
+ */
+typedef struct PendingRelFileNode
+{
+	RelFileNode rnode;			/* hash key */
+	RelFileInfo info;
+	TimestampTz registered;
+} PendingRelFileNode;
+
+static HTAB *pending_relfilenode_map;
+
+/*
+ * The size of each relation, with its indexes and TOAST table rolled up to
+ * it, is published by the worker for the quota.relation_sizes view. The
+ * number of relations can be large, so they're kept in a dynamic shared
+ * memory area rather than in the fixed-size main shared memory segment.
+ */
+struct RelationSizeEntry
+{
+	Oid			relid;			/* OID of the table */
+
+	int64		table_size;		/* all forks of the table itself */
+	int64		indexes_size;	/* all the table's indexes */
+	int64		toast_size;		/* TOAST table and its index */
+	int64		reclaimable;	/* of all of the above */
+	int64		free_space;		/* in the FSM of the table itself */
 };
 
-static HTAB *role_totals_map;
+/*
+ * Result of quota.verify() for one role, see VerifyModel().
+ */
+typedef struct VerifyResult
+{
+	Oid			rolid;			/* owner in the model, or InvalidOid */
+
+	int64		sampled_files;	/* files re-checked */
+	int64		sampled_bytes;	/* their size in the model */
+	int64		missing_files;	/* files that no longer exist */
+	int64		size_mismatches;	/* files whose size was out of date */
+	int64		owner_mismatches;	/* files with the wrong owner */
+	int64		error_bytes;	/* bytes counted wrong, in the sample */
+	int64		estimated_error_bytes;	/* the same, scaled to the model */
+} VerifyResult;
+
+/*
+ * Statistics about the worker's last scan cycle, for monitoring and
+ * benchmarking the scanner. Times are in milliseconds.
+ */
+typedef struct
+{
+	int			pid;			/* PID of the worker */
+	int64		cycles;			/* number of completed cycles */
+	TimestampTz last_cycle_end;
+
+	double		cycle_time;		/* the whole cycle */
+	double		scan_time;		/* walking the directories */
+	double		sweep_time;		/* removing files that were not seen */
+	double		orphans_time;	/* looking up owners of new relations */
+
+	int64		dirs_scanned;	/* directories read */
+	int64		stat_calls;		/* stat() calls */
+	int64		files;			/* files in the model */
+	int64		relations;		/* relations in the model */
+	int64		orphans;		/* relations with no known owner */
+	int64		model_bytes;	/* memory used by the model */
+	int64		skipped_scans;	/* cycles where the probe saw no changes */
+} pg_quota_scan_stats;
+
+/*
+ * Progress of the worker's current cycle, for the quota.scan_progress view.
+ * The worker publishes it every PROGRESS_REPORT_INTERVAL files, and at every
+ * change of phase, under 'mutex' rather than shared->lock, which it
+ * shouldn't take that often during a scan.
+ */
+typedef struct
+{
+	slock_t		mutex;
+	ScanPhase	phase;
+	TimestampTz phase_start;
+
+	int64		dirs_done;
+	int64		dirs_total;
+	int64		files_done;
+	int64		files_total;	/* files in the model after the previous cycle */
+	int64		bytes_done;		/* size of the files seen in this cycle */
+	int64		orphans_remaining;	/* owners still to look up */
+} pg_quota_scan_progress;
+
+/*
+ * Per-database state, one slot for each database in pg_quota.databases.
+ */
+typedef struct
+{
+	Oid			dbid;			/* database, or InvalidOid if not started yet */
+
+	/* array of RelationSizeEntry, sorted by relid, in the DSA area */
+	dsa_pointer relsizes;
+	int			nrelsizes;
+
+	pg_quota_scan_stats scanstats;	/* as of the last completed cycle */
+	pg_quota_scan_progress progress;	/* of the current cycle */
+
+	/*
+	 * All the QuotaEntrys of this database, linked through their db_node, so
+	 * that the monitoring functions don't need to scan the whole hash table.
+	 */
+	dlist_head	entries;
+
+	/*
+	 * quota.verify() requests. A backend sets the parameters, increments
+	 * verify_requested and sets the worker's latch, and waits on verify_cv
+	 * until verify_completed catches up. While a request is pending, another
+	 * backend can only wait for the same one, if its parameters are the
+	 * same. The results of the last completed audit are an array of
+	 * VerifyResult in the DSA area. worker_latch is cleared when the worker
+	 * exits.
+	 */
+	Latch	   *worker_latch;
+	ConditionVariable verify_cv;
+	uint64		verify_requested;
+	uint64		verify_completed;
+	double		verify_fraction;
+	bool		verify_repair;
+	dsa_pointer verify_results;
+	int			nverify_results;
+
+	/*
+	 * Set while the worker sleeps longer than pg_quota.refresh_naptime,
+	 * because its probes saw no changes. The first backend to write to a
+	 * table clears it and wakes the worker up.
+	 */
+	bool		hibernating;
+} pg_quota_db_state;
 
 typedef struct
 {
-	LWLock	   *lock;		/* protects role_totals_map */
+	LWLock	   *lock;		/* protects quota_totals_map, and everything below */
+	LWLock	   *pending_lock;	/* protects pending_relfilenode_map */
+
+	int			area_tranche_id;	/* LWLock tranche for the DSA area */
+	dsa_handle	area_handle;	/* DSA area, created by the first worker */
+
+	int			num_databases;
+	pg_quota_db_state databases[FLEXIBLE_ARRAY_MEMBER];
 } pg_quota_shared_state;
 
 static pg_quota_shared_state *shared;
 
+/* Number of database slots to allocate, set at postmaster startup */
+static int	num_databases;
+
+/* Size of quota_totals_map, from pg_quota.max_entries */
+static int	max_quota_entries;
+
+/* The DSA area, once attached to it */
+static dsa_area *quota_area;
+
+/* Slot of the database this worker is responsible for */
+static pg_quota_db_state *MyDbState;
+static bool exit_callback_registered = false;
+
+/* Statistics of the current cycle, published at the end of it */
+static pg_quota_scan_stats curstats;
+static instr_time cycle_start;
+
+/* Progress of the current cycle, published by ReportProgress() */
+static pg_quota_scan_progress curprogress;
+
+/* Start times of the current and the previous scan */
+static TimestampTz scan_start_time;
+static TimestampTz prev_scan_start_time;
+
+/*
+ * Cheap signature of this database's files, taken at the start of each
+ * cycle. If it hasn't changed since the previous cycle, the full scan can be
+ * skipped. See ProbeChanged().
+ */
+typedef struct
+{
+	int			ndirs;			/* directories of the database */
+	time_t		max_mtime;		/* latest mtime of those directories */
+	int64		nlinks;			/* sum of their link counts */
+	int64		dirsize;		/* sum of their sizes */
+	int64		tuples_changed; /* tuples inserted, updated or deleted */
+	XLogRecPtr	insert_lsn;		/* WAL inserted, on a primary */
+	XLogRecPtr	replay_lsn;		/* WAL replayed, on a hot standby */
+} ProbeSignature;
+
+static ProbeSignature last_probe;
+static TimestampTz last_probe_time = 0;
+
 /*
  * Local memory structures, in the background worker process.
  *
@@ -104,14 +439,62 @@ struct RelSizeEntry
 
 	Oid			owner;
 
+	/* These are filled in from the catalogs together with the owner */
+	Oid			relid;			/* pg_class OID of the relation */
+	Oid			namespace;		/* schema of the relation */
+	Oid			toprelid;		/* table this relation's size is rolled up to */
+	RelSizeKind kind;			/* role of the relation in the rollup */
+
 	int			numfiles;		/* ref count of FileSizeEntrys for this rel */
 	off_t		totalsize;
 
 	dlist_node	orphan_node;	/* link in orphanRels, if owner == InvalidOid */
+
+	/* Reclaimable space, estimated by UpdateReclaimableSpace() */
+	int64		free_bytes;		/* free space recorded in the FSM */
+	int64		dead_bytes;		/* space taken by dead tuples */
+	int64		reclaim_changes;	/* pgstat counters at the last estimate */
+	off_t		reclaim_size;	/* totalsize at the last estimate */
 };
 
 static HTAB *relfilenode_to_relentry_map;
 
+/*
+ * Temporary files are not part of the model, as they don't belong to any
+ * relation. Instead, each scan sums up the temporary files found in the
+ * pgsql_tmp directories, keyed by the PID of the backend that created them
+ * (it's part of the file name), and attributes them to that backend's role.
+ */
+struct TempUsageEntry
+{
+	int			pid;			/* hash key, PID of the creating backend */
+
+	Oid			rolid;			/* role of the backend */
+	off_t		size;			/* total size of its temporary files */
+	bool		cancel;			/* cancel the backend's query? */
+};
+
+/*
+ * Group membership, for group quotas. For each role that is a member of a
+ * group that has a quota, directly or indirectly, the list of those groups.
+ * A group counts as a member of itself. This is rebuilt only when
+ * pg_auth_members, or the set of groups with quotas, changes.
+ */
+struct RoleGroupsEntry
+{
+	Oid			rolid;			/* hash key */
+
+	List	   *groups;			/* OIDs of groups with quotas */
+};
+
+static HTAB *role_to_groups_map;
+
+/* Groups with quotas, as of the last rebuild of role_to_groups_map */
+static List *quotaGroups;
+
+/* Memory context holding role_to_groups_map */
+static MemoryContext GroupContext;
+
 /* List of RelSizeEntrys without owner. */
 static dlist_head orphanRels;
 
@@ -124,14 +507,41 @@ static MemoryContext FsModelContext;
  */
 static int generation;
 
+/*
+ * Likewise, for detecting quotas that have been removed from the
+ * configuration tables.
+ */
+static int quota_generation;
+
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
 static Size pg_quota_memsize(void);
 static void pg_quota_shmem_startup(void);
-
-static bool isRelDataFile(const char *path, RelFileNode *rnode);
+static void fs_model_shmem_exit(int code, Datum arg);
+
+static dsa_area *get_quota_area(bool create);
+static pg_quota_db_state *get_db_state(Oid dbid);
+static QuotaEntry *EnterQuotaEntry(QuotaKind kind, Oid objid);
+static QuotaEntry *EnterQuotaEntryForDb(QuotaKind kind, Oid objid, Oid dbid);
+static QuotaEntry *FindQuotaEntry(QuotaKind kind, Oid objid);
+static QuotaEntry *FindQuotaEntryForDb(QuotaKind kind, Oid objid, Oid dbid);
+static void AddToEntryTotal(QuotaKind kind, Oid objid, Oid dbid, int64 delta);
+static void AddToTotals(RelSizeEntry *relentry, int64 delta);
+static void AddToCounts(RelSizeEntry *relentry, int relations, int files);
+static void AddToDatabaseTotal(int64 delta);
 static void RemoveFileSize(FileSizeEntry *fsentry);
 static void UpdateFileSize(RelFileNode *rnode, char *filename, off_t newsize);
+static void RefreshTempUsage(void);
+static void UpdateUsageHistory(void);
+static void ReportProgress(void);
+static void SweepRemovedFiles(void);
+static List *CollectScanDirs(void);
+static bool ProbeChanged(List *dirs);
+static void TakePendingRelFileNodes(RelSizeEntry **orphans, int norphans,
+						RelFileInfo *infos, bool *found);
+static void PurgePendingRelFileNodes(void);
+static void RemoveDatabaseEntries(void);
+static void RecomputeClusterQuotas(void);
 
 /*
  * Does it look like a relation data file?
@@ -140,7 +550,7 @@ static void UpdateFileSize(RelFileNode *rnode, char *filename, off_t newsize);
  *
  * Adapted from pg_rewind's similar function.
  */
-static bool
+bool
 isRelDataFile(const char *path, RelFileNode *rnode)
 {
 	int			nmatch;
@@ -208,13 +618,13 @@ isRelDataFile(const char *path, RelFileNode *rnode)
 
 /*
  * Per-worker initialization. Create local hashes.
+ *
+ * 'slotno' is the index of the worker's database in pg_quota.databases.
  */
 void
-init_fs_model(void)
+init_fs_model(int slotno)
 {
 	HASHCTL		hash_ctl;
-	HASH_SEQ_STATUS iter;
-	RoleSizeEntry *rolentry;
 
 	if (FsModelContext)
 		MemoryContextDelete(FsModelContext);
@@ -246,37 +656,129 @@ init_fs_model(void)
 
 	memset(&orphanRels, 0, sizeof(orphanRels));
 
+	GroupContext = AllocSetContextCreate(FsModelContext,
+										 "Disk quotas group membership context",
+										 ALLOCSET_SMALL_SIZES);
+	role_to_groups_map = NULL;
+	quotaGroups = NIL;
+
+	(void) get_quota_area(true);
+
 	/*
 	 * Remove any old entries for this database from the shared memory hash
 	 * table, in case an old worker died and left them behind.
 	 */
 	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
 
-	hash_seq_init(&iter, role_totals_map);
+	Assert(slotno >= 0 && slotno < shared->num_databases);
+	MyDbState = &shared->databases[slotno];
+	MyDbState->dbid = MyDatabaseId;
+	memset(&MyDbState->scanstats, 0, sizeof(pg_quota_scan_stats));
+	MyDbState->scanstats.pid = MyProcPid;
+	MyDbState->worker_latch = MyLatch;
+	MyDbState->hibernating = false;
+	if (!exit_callback_registered)
+	{
+		/* before_shmem_exit, so that the DSA area is still attached */
+		before_shmem_exit(fs_model_shmem_exit, (Datum) 0);
+		exit_callback_registered = true;
+	}
+
+	memset(&curstats, 0, sizeof(curstats));
+	curstats.pid = MyProcPid;
+
+	/* Clear any progress left behind by an old worker */
+	memset(&curprogress, 0, sizeof(curprogress));
+	ReportProgress();
+
+	RemoveDatabaseEntries();
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Remove the entries of this worker's database from the shared memory hash
+ * table, and take the database's share out of the cluster-wide totals and
+ * quotas. Caller must hold shared->lock in exclusive mode.
+ */
+static void
+RemoveDatabaseEntries(void)
+{
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
 
-	while ((rolentry = hash_seq_search(&iter)) != NULL)
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
 	{
-		/* only reset entries for current db */
-		if (rolentry->key.dbid == MyDatabaseId)
+		if (qentry->key.dbid != MyDatabaseId)
+			continue;
+
+		/* Take this database's share out of the cluster-wide total */
+		if (qentry->key.kind == QUOTA_ROLE && qentry->totalsize != 0)
 		{
-			(void) hash_search(role_totals_map,
-							   (void *) rolentry,
-							   HASH_REMOVE, NULL);
+			QuotaEntry *clusterentry;
+
+			clusterentry = FindQuotaEntryForDb(QUOTA_ROLE,
+											   qentry->key.objid,
+											   InvalidOid);
+			if (clusterentry)
+				clusterentry->totalsize -= qentry->totalsize;
 		}
+
+		if (DsaPointerIsValid(qentry->history) && quota_area)
+			dsa_free(quota_area, qentry->history);
+		(void) hash_search(quota_totals_map,
+						   (void *) qentry,
+						   HASH_REMOVE, NULL);
 	}
+	/* The old entries are gone, and so is the list of them */
+	dlist_init(&MyDbState->entries);
+
+	/* The database's cluster_quota settings went with its role entries */
+	RecomputeClusterQuotas();
+}
+
+/*
+ * Clean up when the worker exits.
+ *
+ * The database's entries are removed, so that its usage, and its setting of
+ * the cluster-wide quotas, don't linger if the database is dropped, or its
+ * worker can't be started again. A new worker bootstraps them again.
+ *
+ * Backends are told that the worker is gone, so that quota.verify() doesn't
+ * wait for it forever. Backends waiting for a verification are woken up,
+ * and error out.
+ */
+static void
+fs_model_shmem_exit(int code, Datum arg)
+{
+	if (!shared || !MyDbState)
+		return;
+
+	/* We might be exiting because of an error while holding the lock */
+	LWLockReleaseAll();
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	MyDbState->worker_latch = NULL;
+	MyDbState->hibernating = false;
+	RemoveDatabaseEntries();
 	LWLockRelease(shared->lock);
+
+	ConditionVariableBroadcast(&MyDbState->verify_cv);
 }
 
 void
-init_fs_model_shmem(void)
+init_fs_model_shmem(int ndatabases, int max_entries)
 {
+	num_databases = ndatabases;
+	max_quota_entries = max_entries;
+
 	/*
 	 * Request additional shared resources.  (These are no-ops if we're not in
 	 * the postmaster process.)  We'll allocate or attach to the shared
 	 * resources in pgss_shmem_startup().
 	 */
 	RequestAddinShmemSpace(pg_quota_memsize());
-	RequestNamedLWLockTranche("pg_quota", 1);
+	RequestNamedLWLockTranche("pg_quota", 2);
 
 	/*
 	 * Install startup hook to initialize our shared memory.
@@ -291,9 +793,13 @@ pg_quota_memsize(void)
 {
 	Size		size;
 
-	size = MAXALIGN(sizeof(pg_quota_shared_state));
-	size = add_size(size, hash_estimate_size(MAX_DB_ROLE_ENTRIES,
-											 sizeof(RoleSizeEntry)));
+	size = MAXALIGN(add_size(offsetof(pg_quota_shared_state, databases),
+							 mul_size(num_databases,
+									  sizeof(pg_quota_db_state))));
+	size = add_size(size, hash_estimate_size(max_quota_entries,
+											 sizeof(QuotaEntry)));
+	size = add_size(size, hash_estimate_size(MAX_PENDING_RELFILENODES,
+											 sizeof(PendingRelFileNode)));
 	return size;
 }
 
@@ -311,167 +817,446 @@ pg_quota_shmem_startup(void)
 
 	/* reset in case this is a restart within the postmaster */
 	shared = NULL;
-	role_totals_map = NULL;
+	quota_totals_map = NULL;
+	pending_relfilenode_map = NULL;
 
 	/*
-	 * The RoleSizeEntry hash table is kept in shared memory, so that backends
+	 * The QuotaEntry hash table is kept in shared memory, so that backends
 	 * can do lookups in it.
 	 */
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
 	shared = ShmemInitStruct("pg_quota",
-							 sizeof(pg_quota_shared_state),
+							 add_size(offsetof(pg_quota_shared_state, databases),
+									  mul_size(num_databases,
+											   sizeof(pg_quota_db_state))),
 							 &found);
 	if (!found)
 	{
-		shared->lock = &(GetNamedLWLockTranche("pg_quota"))->lock;
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_quota");
+		int			i;
+
+		shared->lock = &locks[0].lock;
+		shared->pending_lock = &locks[1].lock;
+		shared->area_tranche_id = LWLockNewTrancheId();
+		shared->area_handle = DSA_HANDLE_INVALID;
+
+		shared->num_databases = num_databases;
+		for (i = 0; i < num_databases; i++)
+		{
+			shared->databases[i].dbid = InvalidOid;
+			shared->databases[i].relsizes = InvalidDsaPointer;
+			shared->databases[i].nrelsizes = 0;
+			memset(&shared->databases[i].scanstats, 0,
+				   sizeof(pg_quota_scan_stats));
+			memset(&shared->databases[i].progress, 0,
+				   sizeof(pg_quota_scan_progress));
+			SpinLockInit(&shared->databases[i].progress.mutex);
+			dlist_init(&shared->databases[i].entries);
+			shared->databases[i].worker_latch = NULL;
+			ConditionVariableInit(&shared->databases[i].verify_cv);
+			shared->databases[i].verify_requested = 0;
+			shared->databases[i].verify_completed = 0;
+			shared->databases[i].verify_results = InvalidDsaPointer;
+			shared->databases[i].nverify_results = 0;
+			shared->databases[i].hibernating = false;
+		}
 	}
 
 	memset(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = sizeof(RoleSizeEntryKey);
-	hash_ctl.entrysize = sizeof(RoleSizeEntry);
-	role_totals_map = ShmemInitHash("role OID to RoleSizeEntry map",
-									MAX_DB_ROLE_ENTRIES,
-									MAX_DB_ROLE_ENTRIES,
+	hash_ctl.keysize = sizeof(QuotaEntryKey);
+	hash_ctl.entrysize = sizeof(QuotaEntry);
+	quota_totals_map = ShmemInitHash("role OID to QuotaEntry map",
+									max_quota_entries,
+									max_quota_entries,
 									&hash_ctl,
 									HASH_ELEM | HASH_BLOBS);
 
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(RelFileNode);
+	hash_ctl.entrysize = sizeof(PendingRelFileNode);
+	pending_relfilenode_map = ShmemInitHash("pending relfilenode map",
+											MAX_PENDING_RELFILENODES,
+											MAX_PENDING_RELFILENODES,
+											&hash_ctl,
+											HASH_ELEM | HASH_BLOBS);
+
 	LWLockRelease(AddinShmemInitLock);
 }
 
-static void
-RemoveFileSize(FileSizeEntry *fsentry)
+/*
+ * Attach to the DSA area.
+ *
+ * The area is created by the first worker that needs it, and pinned so that
+ * it stays around even if that worker exits. Returns NULL if the area
+ * doesn't exist yet, and 'create' is false.
+ */
+static dsa_area *
+get_quota_area(bool create)
 {
-	RelSizeEntry *relentry = fsentry->parent;
-	int64		filesize = fsentry->filesize;
-	Oid			owner = relentry->owner;
-	bool		found;
+	MemoryContext oldcontext;
 
-	/* Remove the FileSizeEntry. */
-	(void) hash_search(path_to_fsentry_map,
-					   (void *) fsentry->path,
-					   HASH_REMOVE, &found);
-	Assert(found);
+	if (quota_area)
+		return quota_area;
 
-	/*
-	 * Update the parent relation. If this was the last file of this relation,
-	 * remove the entry for the relation altogether.
-	 */
-	relentry->totalsize -= filesize;
-	relentry->numfiles--;
-	if (relentry->numfiles == 0)
+	if (!shared)
+		return NULL;
+
+	LWLockRegisterTranche(shared->area_tranche_id, "pg_quota_area");
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	if (shared->area_handle != DSA_HANDLE_INVALID)
+		quota_area = dsa_attach(shared->area_handle);
+	else if (create)
 	{
-		Assert(relentry->totalsize == 0);
-		if (relentry->owner == InvalidOid)
-			dlist_delete(&relentry->orphan_node);
-		(void) hash_search(relfilenode_to_relentry_map,
-						   (void *) relentry,
-						   HASH_REMOVE, &found);
-		Assert(found);
+		quota_area = dsa_create(shared->area_tranche_id);
+		dsa_pin(quota_area);
+		shared->area_handle = dsa_get_handle(quota_area);
 	}
+	LWLockRelease(shared->lock);
 
-	/*
-	 * If we know the owner of this file, update its totals too.
-	 */
-	if (OidIsValid(owner) && filesize != 0)
-	{
-		RoleSizeEntry *rolentry;
-		RoleSizeEntryKey key;
+	/* Stay attached for the lifetime of the process */
+	if (quota_area)
+		dsa_pin_mapping(quota_area);
 
-		LWLockAcquire(shared->lock, LW_SHARED);
+	MemoryContextSwitchTo(oldcontext);
 
-		key.rolid = owner;
-		key.dbid = MyDatabaseId;
-		rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-												 (void *) &key,
-												 HASH_FIND, NULL);
-		if (rolentry)
-			rolentry->totalsize -= filesize;
-		else
-		{
-			/* shouldn't happen */
-			elog(DEBUG1, "role total not found, corrupt map?");
-		}
+	return quota_area;
+}
 
-		LWLockRelease(shared->lock);
+/*
+ * Find the slot for a database. Caller must hold shared->lock.
+ */
+static pg_quota_db_state *
+get_db_state(Oid dbid)
+{
+	int			i;
+
+	for (i = 0; i < shared->num_databases; i++)
+	{
+		if (shared->databases[i].dbid == dbid)
+			return &shared->databases[i];
 	}
+	return NULL;
 }
 
 /*
- * Update the model with the size of one file.
+ * Find or create the QuotaEntry for an object in the current database.
+ *
+ * Caller must hold shared->lock in exclusive mode.
  */
-static void
-UpdateFileSize(RelFileNode *rnode, char *path, off_t newsize)
+static QuotaEntry *
+EnterQuotaEntry(QuotaKind kind, Oid objid)
 {
-	RelSizeEntry *relentry;
-	FileSizeEntry *fsentry;
+	return EnterQuotaEntryForDb(kind, objid, MyDatabaseId);
+}
+
+/*
+ * Like EnterQuotaEntry(), but for any database, or InvalidOid for the
+ * cluster-wide entry.
+ *
+ * Returns NULL if the entry doesn't exist, and there's no room for it. The
+ * object's usage is then not tracked, and its quotas are not enforced, but
+ * the worker keeps going.
+ */
+static QuotaEntry *
+EnterQuotaEntryForDb(QuotaKind kind, Oid objid, Oid dbid)
+{
+	static bool full_reported = false;
+	QuotaEntry *qentry;
+	QuotaEntryKey key;
 	bool		found;
-	off_t		oldsize;
 
-	/* Find or create entry for this relation */
-	relentry = (RelSizeEntry *) hash_search(relfilenode_to_relentry_map,
-											(void *) rnode,
-											HASH_ENTER, &found);
-	if (!found)
+	memset(&key, 0, sizeof(key));
+	key.kind = kind;
+	key.objid = objid;
+	key.dbid = dbid;
+	qentry = (QuotaEntry *) hash_search(quota_totals_map,
+										(void *) &key,
+										HASH_ENTER_NULL, &found);
+	if (qentry == NULL)
 	{
-		relentry->owner = InvalidOid;
-		dlist_push_head(&orphanRels, &relentry->orphan_node);
-
-		relentry->numfiles = 0;
-		relentry->totalsize = 0;
+		/* Once per worker is enough */
+		if (!full_reported)
+			ereport(LOG,
+					(errmsg("pg_quota could not track the usage of all objects, because the shared memory table is full"),
+					 errhint("Increase pg_quota.max_entries, currently %d.",
+							 max_quota_entries)));
+		full_reported = true;
+		return NULL;
 	}
-
-	/* Find or create entry for this file */
-	fsentry = (FileSizeEntry *) hash_search(path_to_fsentry_map,
-											(void *) path,
-											HASH_ENTER, &found);
 	if (!found)
 	{
-		fsentry->parent = relentry;
-		relentry->numfiles++;
-		fsentry->filesize = 0;
+		qentry->totalsize = 0;
+		qentry->quota = -1;	/* -1 means no quota */
+		qentry->temp_used = 0;
+		qentry->temp_quota = -1;
+		qentry->nrelations = 0;
+		qentry->nfiles = 0;
+		qentry->max_relations = -1;
+		qentry->max_files = -1;
+		qentry->group_exceeded = false;
+		qentry->cluster_quota = -1;
+		qentry->quota_generation = 0;
+		qentry->cluster_quota_generation = 0;
+		qentry->notified_threshold = 0;
+		qentry->growth_rate = 0;
+		qentry->rate_size = 0;
+		qentry->rate_time = 0;
+		qentry->history = InvalidDsaPointer;
+		qentry->reclaimable = 0;
+		qentry->free_space = 0;
+
+		/* Entries of other databases are only created by their workers */
+		if (dbid == MyDatabaseId)
+			dlist_push_tail(&MyDbState->entries, &qentry->db_node);
 	}
-	Assert(relentry->numfiles > 0);
-	Assert(fsentry->parent == relentry);
 
-	/* Update file size */
-	oldsize = fsentry->filesize;
-	fsentry->filesize = newsize;
+	return qentry;
+}
 
-	/* also touch 'generation', to remember that we saw this file to exist */
-	fsentry->generation = generation;
+/*
+ * Find the QuotaEntry for an object in the current database, or NULL if
+ * there is none.
+ *
+ * Caller must hold shared->lock.
+ */
+static QuotaEntry *
+FindQuotaEntry(QuotaKind kind, Oid objid)
+{
+	return FindQuotaEntryForDb(kind, objid, MyDatabaseId);
+}
 
-	/*
-	 * If the file size changed, must also update the totals for the relation
-	 * and the owner.
-	 */
-	if (newsize != oldsize)
-	{
-		relentry->totalsize += (newsize - oldsize);
+/*
+ * Like FindQuotaEntry(), but for any database, or InvalidOid for the
+ * cluster-wide entry.
+ */
+static QuotaEntry *
+FindQuotaEntryForDb(QuotaKind kind, Oid objid, Oid dbid)
+{
+	QuotaEntryKey key;
+
+	memset(&key, 0, sizeof(key));
+	key.kind = kind;
+	key.objid = objid;
+	key.dbid = dbid;
+	return (QuotaEntry *) hash_search(quota_totals_map,
+									  (void *) &key,
+									  HASH_FIND, NULL);
+}
 
-		if (relentry->owner)
+/*
+ * Add 'delta' to the total of one object, if there's room for its entry.
+ *
+ * Caller must hold shared->lock in exclusive mode.
+ */
+static void
+AddToEntryTotal(QuotaKind kind, Oid objid, Oid dbid, int64 delta)
+{
+	QuotaEntry *qentry = EnterQuotaEntryForDb(kind, objid, dbid);
+
+	if (qentry)
+		qentry->totalsize += delta;
+}
+
+/*
+ * Add 'delta' to the totals of the role, schema and tablespace that a
+ * relation is counted towards, and to the groups that the role is a member
+ * of. Relations whose owner is not known yet are not counted towards
+ * anything.
+ *
+ * Caller must hold shared->lock in exclusive mode.
+ */
+static void
+AddToTotals(RelSizeEntry *relentry, int64 delta)
+{
+	if (!OidIsValid(relentry->owner) || delta == 0)
+		return;
+
+	AddToEntryTotal(QUOTA_ROLE, relentry->owner, MyDatabaseId, delta);
+	AddToEntryTotal(QUOTA_ROLE, relentry->owner, InvalidOid, delta);
+	if (role_to_groups_map)
+	{
+		RoleGroupsEntry *rgentry;
+		ListCell   *lc;
+
+		rgentry = (RoleGroupsEntry *) hash_search(role_to_groups_map,
+												  (void *) &relentry->owner,
+												  HASH_FIND, NULL);
+		if (rgentry)
 		{
-			RoleSizeEntry *rolentry;
-			RoleSizeEntryKey key;
+			foreach(lc, rgentry->groups)
+				AddToEntryTotal(QUOTA_GROUP, lfirst_oid(lc), MyDatabaseId, delta);
+		}
+	}
+	AddToEntryTotal(QUOTA_NAMESPACE, relentry->namespace, MyDatabaseId, delta);
+	AddToEntryTotal(QUOTA_TABLESPACE, relentry->rnode.spcNode, MyDatabaseId, delta);
+}
 
-			LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+/*
+ * Add 'delta' to the total of the whole database. Unlike the other totals,
+ * this includes files whose owner is not known. Like the rest of the model,
+ * it doesn't include system catalogs, or files that don't belong to any
+ * relation, which pg_database_size() does count.
+ *
+ * Caller must hold shared->lock in exclusive mode.
+ */
+static void
+AddToDatabaseTotal(int64 delta)
+{
+	if (delta == 0)
+		return;
 
-			key.rolid = relentry->owner;
-			key.dbid = MyDatabaseId;
-			rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-													 (void *) &key,
-													 HASH_ENTER, &found);
-			if (!found)
-			{
-				rolentry->totalsize = 0;
-				rolentry->quota = -1;
-			}
+	AddToEntryTotal(QUOTA_DATABASE, MyDatabaseId, MyDatabaseId, delta);
+}
+
+/*
+ * Add to the number of relations and files owned by the owner of a relation.
+ * Like AddToTotals(), does nothing if the owner is not known yet.
+ *
+ * Caller must hold shared->lock in exclusive mode.
+ */
+static void
+AddToCounts(RelSizeEntry *relentry, int relations, int files)
+{
+	QuotaEntry *qentry;
+
+	if (!OidIsValid(relentry->owner))
+		return;
+
+	qentry = EnterQuotaEntry(QUOTA_ROLE, relentry->owner);
+	if (qentry)
+	{
+		qentry->nrelations += relations;
+		qentry->nfiles += files;
+	}
+}
+
+static void
+RemoveFileSize(FileSizeEntry *fsentry)
+{
+	RelSizeEntry *relentry = fsentry->parent;
+	int64		filesize = fsentry->filesize;
+	bool		found;
+
+	/*
+	 * Update the totals first. The owner's totals are only updated if we
+	 * know the owner of this file.
+	 */
+	if (filesize != 0 || OidIsValid(relentry->owner))
+	{
+		LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+		AddToDatabaseTotal(-filesize);
+		AddToTotals(relentry, -filesize);
+		AddToCounts(relentry, relentry->numfiles == 1 ? -1 : 0, -1);
+		LWLockRelease(shared->lock);
+	}
+
+	/* Remove the FileSizeEntry. */
+	(void) hash_search(path_to_fsentry_map,
+					   (void *) fsentry->path,
+					   HASH_REMOVE, &found);
+	Assert(found);
+
+	/*
+	 * Update the parent relation. If this was the last file of this relation,
+	 * remove the entry for the relation altogether.
+	 */
+	relentry->totalsize -= filesize;
+	relentry->numfiles--;
+	if (relentry->numfiles == 0)
+	{
+		Assert(relentry->totalsize == 0);
+		if (relentry->owner == InvalidOid)
+			dlist_delete(&relentry->orphan_node);
+		(void) hash_search(relfilenode_to_relentry_map,
+						   (void *) relentry,
+						   HASH_REMOVE, &found);
+		Assert(found);
+	}
+}
+
+/*
+ * Update the model with the size of one file.
+ */
+static void
+UpdateFileSize(RelFileNode *rnode, char *path, off_t newsize)
+{
+	RelSizeEntry *relentry;
+	FileSizeEntry *fsentry;
+	bool		found;
+	off_t		oldsize;
+
+	/* Find or create entry for this relation */
+	relentry = (RelSizeEntry *) hash_search(relfilenode_to_relentry_map,
+											(void *) rnode,
+											HASH_ENTER, &found);
+	if (!found)
+	{
+		relentry->owner = InvalidOid;
+		relentry->relid = InvalidOid;
+		relentry->namespace = InvalidOid;
+		relentry->toprelid = InvalidOid;
+		relentry->kind = RELSIZE_TABLE;
+		dlist_push_head(&orphanRels, &relentry->orphan_node);
+
+		relentry->numfiles = 0;
+		relentry->totalsize = 0;
+
+		relentry->free_bytes = 0;
+		relentry->dead_bytes = 0;
+		relentry->reclaim_changes = -1;
+		relentry->reclaim_size = -1;
+	}
 
-			rolentry->totalsize += (newsize - oldsize);
+	/* Find or create entry for this file */
+	fsentry = (FileSizeEntry *) hash_search(path_to_fsentry_map,
+											(void *) path,
+											HASH_ENTER, &found);
+	if (!found)
+	{
+		fsentry->parent = relentry;
+		relentry->numfiles++;
+		fsentry->filesize = 0;
 
+		if (relentry->owner)
+		{
+			LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+			AddToCounts(relentry, 0, 1);
 			LWLockRelease(shared->lock);
 		}
 	}
+	Assert(relentry->numfiles > 0);
+	Assert(fsentry->parent == relentry);
+
+	/* Update file size */
+	oldsize = fsentry->filesize;
+	fsentry->filesize = newsize;
+
+	/* also touch 'generation', to remember that we saw this file to exist */
+	fsentry->generation = generation;
+
+	curprogress.files_done++;
+	curprogress.bytes_done += newsize;
+	if (curprogress.files_done % PROGRESS_REPORT_INTERVAL == 0)
+		ReportProgress();
+
+	/*
+	 * If the file size changed, must also update the totals for the relation,
+	 * and the owner, schema and tablespace.
+	 */
+	if (newsize != oldsize)
+	{
+		relentry->totalsize += (newsize - oldsize);
+
+		LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+		AddToDatabaseTotal(newsize - oldsize);
+		if (relentry->owner)
+			AddToTotals(relentry, newsize - oldsize);
+		LWLockRelease(shared->lock);
+	}
 }
 
 /*
@@ -485,10 +1270,13 @@ RebuildRelSizeMapDir(char *dirpath)
 	char		path[MAXPGPATH];
 
 	dirdesc = AllocateDir(dirpath);
+	curstats.dirs_scanned++;
+
+	/* The sizes are collected in batches, see stat_batch.c */
+	StatBatchBegin(UpdateFileSize);
 
 	while((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
 	{
-		struct stat statbuf;
 		RelFileNode rnode;
 
 		if (strcmp(dirent->d_name, ".") == 0 ||
@@ -508,6 +1296,94 @@ RebuildRelSizeMapDir(char *dirpath)
 		if (rnode.relNode < FirstNormalObjectId)
 			continue;
 
+		curstats.stat_calls++;
+		StatBatchAdd(&rnode, path);
+	}
+
+	StatBatchFlush();
+
+	FreeDir(dirdesc);
+
+	ReportProgress();
+}
+
+/*
+ * Add all the files of one relation to the model, like the directory scan
+ * would: every segment of every fork. This is used to bootstrap the model
+ * with the relations that matter most, before the first full scan.
+ */
+void
+ScanRelationFiles(Oid spcid, Oid relfilenode)
+{
+	ForkNumber	forknum;
+
+	if (relfilenode < FirstNormalObjectId)
+		return;
+
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+	{
+		char	   *relpath;
+		int			segno;
+
+		relpath = GetRelationPath(MyDatabaseId, spcid, relfilenode,
+								  InvalidBackendId, forknum);
+
+		for (segno = 0;; segno++)
+		{
+			char		path[MAXPGPATH];
+			struct stat statbuf;
+			RelFileNode rnode;
+
+			if (segno == 0)
+				strlcpy(path, relpath, MAXPGPATH);
+			else
+				snprintf(path, MAXPGPATH, "%s.%d", relpath, segno);
+
+			curstats.stat_calls++;
+			if (stat(path, &statbuf) != 0)
+			{
+				if (errno != ENOENT)
+					ereport(DEBUG1,
+							(errcode_for_file_access(),
+							 errmsg("could not stat file \"%s\": %m", path)));
+				break;
+			}
+
+			/* Derive the key the same way as the directory scan */
+			if (!isRelDataFile(path, &rnode))
+				break;
+			UpdateFileSize(&rnode, path, statbuf.st_size);
+		}
+
+		pfree(relpath);
+	}
+}
+
+/*
+ * Returns the total size of the files in a shared fileset directory.
+ *
+ * Temporary files shared between parallel workers live in a subdirectory
+ * called pgsql_tmp<PID>.<n>.sharedfileset, named after the creating backend.
+ */
+static off_t
+GetTempDirSize(const char *dirpath)
+{
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+	off_t		size = 0;
+
+	dirdesc = AllocateDir(dirpath);
+	while ((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
+	{
+		struct stat statbuf;
+
+		if (strcmp(dirent->d_name, ".") == 0 ||
+			strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", dirpath, dirent->d_name);
+		curstats.stat_calls++;
 		if (stat(path, &statbuf) != 0)
 		{
 			ereport(DEBUG1,
@@ -515,251 +1391,3170 @@ RebuildRelSizeMapDir(char *dirpath)
 					 errmsg("could not stat file \"%s\": %m", path)));
 			continue;
 		}
-
-		UpdateFileSize(&rnode, dirent->d_name, statbuf.st_size);
+		if (S_ISREG(statbuf.st_mode))
+			size += statbuf.st_size;
 	}
+	FreeDir(dirdesc);
+
+	return size;
+}
+
+/*
+ * helper function for RefreshTempUsage(), to scan one pgsql_tmp directory.
+ */
+static void
+ScanTempDir(const char *dirpath, HTAB *pid_to_tempentry_map)
+{
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+
+	/*
+	 * The directory is only created when the first temporary file is, so
+	 * it's normal for it to be missing.
+	 */
+	dirdesc = AllocateDir(dirpath);
+	while ((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
+	{
+		struct stat statbuf;
+		TempUsageEntry *tempentry;
+		PGPROC	   *proc;
+		int			pid;
+		off_t		size;
+		bool		found;
+
+		/* Temporary files are named pgsql_tmp<PID>.<n> */
+		if (strncmp(dirent->d_name, PG_TEMP_FILE_PREFIX,
+					strlen(PG_TEMP_FILE_PREFIX)) != 0)
+			continue;
+		if (sscanf(dirent->d_name + strlen(PG_TEMP_FILE_PREFIX), "%d", &pid) != 1)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", dirpath, dirent->d_name);
+		curstats.stat_calls++;
+		if (lstat(path, &statbuf) != 0)
+		{
+			ereport(DEBUG1,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", path)));
+			continue;
+		}
+
+		if (S_ISDIR(statbuf.st_mode))
+			size = GetTempDirSize(path);
+		else
+			size = statbuf.st_size;
+		if (size == 0)
+			continue;
 
+		/*
+		 * Find the backend that created the file. Files left behind by
+		 * backends that have already exited, or that belong to other
+		 * databases, are not our business.
+		 */
+		proc = BackendPidGetProc(pid);
+		if (proc == NULL || proc->databaseId != MyDatabaseId ||
+			!OidIsValid(proc->roleId))
+			continue;
+
+		tempentry = (TempUsageEntry *) hash_search(pid_to_tempentry_map,
+												   (void *) &pid,
+												   HASH_ENTER, &found);
+		if (!found)
+		{
+			tempentry->rolid = proc->roleId;
+			tempentry->size = 0;
+			tempentry->cancel = false;
+		}
+		tempentry->size += size;
+	}
 	FreeDir(dirdesc);
 }
 
+/*
+ * Recompute the temporary file usage of each role in this database.
+ *
+ * If a role has exceeded its temporary file quota, the queries of the
+ * backends holding its temporary files are canceled. This is done here,
+ * rather than in the backends, because a sort or hash join that keeps
+ * writing temporary files doesn't pass through any hook where the backend
+ * could check the quota itself.
+ */
+static void
+RefreshTempUsage(void)
+{
+	HASHCTL		hash_ctl;
+	HTAB	   *pid_to_tempentry_map;
+	HASH_SEQ_STATUS iter;
+	TempUsageEntry *tempentry;
+	QuotaEntry *qentry;
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(int);
+	hash_ctl.entrysize = sizeof(TempUsageEntry);
+	hash_ctl.hcxt = FsModelContext;
+
+	pid_to_tempentry_map = hash_create("PID to TempUsageEntry map",
+									   64,
+									   &hash_ctl,
+									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* base/pgsql_tmp */
+	snprintf(path, MAXPGPATH, "base/%s", PG_TEMP_FILES_DIR);
+	ScanTempDir(path, pid_to_tempentry_map);
+
+	/* pg_tblspc/<tblspc oid>/<tblspc version>/pgsql_tmp */
+	dirdesc = AllocateDir("pg_tblspc");
+	while ((dirent = ReadDirExtended(dirdesc, "pg_tblspc", DEBUG1)) != NULL)
+	{
+		Oid			spcid;
+
+		if (sscanf(dirent->d_name, "%u", &spcid) != 1)
+			continue;
+
+		snprintf(path, MAXPGPATH, "pg_tblspc/%s/%s/%s",
+				 dirent->d_name, TABLESPACE_VERSION_DIRECTORY,
+				 PG_TEMP_FILES_DIR);
+		ScanTempDir(path, pid_to_tempentry_map);
+	}
+	FreeDir(dirdesc);
+
+	/* Publish the new totals. */
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (qentry->key.dbid == MyDatabaseId &&
+			qentry->key.kind == QUOTA_ROLE)
+			qentry->temp_used = 0;
+	}
+
+	hash_seq_init(&iter, pid_to_tempentry_map);
+	while ((tempentry = hash_seq_search(&iter)) != NULL)
+	{
+		qentry = EnterQuotaEntry(QUOTA_ROLE, tempentry->rolid);
+		if (qentry)
+			qentry->temp_used += tempentry->size;
+	}
+
+	/* Decide which backends to cancel, now that the totals are complete. */
+	hash_seq_init(&iter, pid_to_tempentry_map);
+	while ((tempentry = hash_seq_search(&iter)) != NULL)
+	{
+		qentry = FindQuotaEntry(QUOTA_ROLE, tempentry->rolid);
+		if (qentry && qentry->temp_quota >= 0 &&
+			qentry->temp_used > qentry->temp_quota)
+			tempentry->cancel = true;
+	}
+
+	LWLockRelease(shared->lock);
+
+	hash_seq_init(&iter, pid_to_tempentry_map);
+	while ((tempentry = hash_seq_search(&iter)) != NULL)
+	{
+		PGPROC	   *proc;
+
+		if (!tempentry->cancel)
+			continue;
+
+		/*
+		 * The backend may have exited since the scan, and its PID been
+		 * recycled. Check again that it's still a backend of the same role
+		 * in this database, right before signalling it. That leaves a
+		 * window as narrow as pg_cancel_backend()'s.
+		 */
+		proc = BackendPidGetProc(tempentry->pid);
+		if (proc == NULL || proc->databaseId != MyDatabaseId ||
+			proc->roleId != tempentry->rolid)
+			continue;
+
+		ereport(LOG,
+				(errmsg("canceling query of process %d, role %u exceeded its temporary file quota",
+						tempentry->pid, tempentry->rolid)));
+
+		/* Like pg_signal_backend(), signal the process group if we can */
+#ifdef HAVE_SETSID
+		if (kill(-tempentry->pid, SIGINT) != 0)
+#else
+		if (kill(tempentry->pid, SIGINT) != 0)
+#endif
+			ereport(DEBUG1,
+					(errmsg("could not send signal to process %d: %m",
+							tempentry->pid)));
+	}
+
+	hash_destroy(pid_to_tempentry_map);
+}
+
+/*
+ * Remove the files that were not seen in the current generation.
+ */
+static void
+SweepRemovedFiles(void)
+{
+	HASH_SEQ_STATUS iter;
+	FileSizeEntry *fsentry;
+
+	hash_seq_init(&iter, path_to_fsentry_map);
+
+	while ((fsentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (fsentry->generation != generation)
+		{
+			/*
+			 * We didn't see this file during this scan, so it doesn't
+			 * exist anymore.
+			 */
+			RemoveFileSize(fsentry);
+		}
+	}
+}
+
+/*
+ * Collect the directories of this database to scan, in pg_default and other
+ * tablespaces. They're collected first, so that they can be probed, and
+ * divided among helper workers.
+ */
+static List *
+CollectScanDirs(void)
+{
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+	List	   *dirs = NIL;
+
+	/* global/<relid> */
+	/* ignore shared relations */
+
+	/* base/<dbid>/<relid> */
+	dirdesc = AllocateDir("base");
+	while ((dirent = ReadDirExtended(dirdesc, "base", DEBUG1)) != NULL)
+	{
+		Oid			dbid;
+
+		if (strcmp(dirent->d_name, ".") == 0 ||
+			strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (sscanf(dirent->d_name, "%u", &dbid) != 1)
+			continue;
+
+		/* Other databases are tracked by their own workers */
+		if (dbid != MyDatabaseId)
+			continue;
+
+		snprintf(path, MAXPGPATH, "base/%s", dirent->d_name);
+		dirs = lappend(dirs, pstrdup(path));
+	}
+	FreeDir(dirdesc);
+
+	/*
+	 * pg_tblspc/<tblspc oid>/<tblspc version>/<dbid>/<relid>
+	 *		within a non-default tablespace (the name of the directory
+	 *		depends on version)
+	 */
+	dirdesc = AllocateDir("pg_tblspc");
+	while ((dirent = ReadDirExtended(dirdesc, "pg_tblspc", DEBUG1)) != NULL)
+	{
+		Oid			spcid;
+
+		if (sscanf(dirent->d_name, "%u", &spcid) != 1)
+			continue;
+
+		snprintf(path, MAXPGPATH, "pg_tblspc/%s/%s/%u",
+				 dirent->d_name, TABLESPACE_VERSION_DIRECTORY, MyDatabaseId);
+
+		/* Skip tablespaces that don't contain anything of this database */
+		if (access(path, F_OK) != 0)
+			continue;
+
+		dirs = lappend(dirs, pstrdup(path));
+	}
+	FreeDir(dirdesc);
+
+	return dirs;
+}
+
+/*
+ * Probe for changes since the previous cycle, without stat()ing every file.
+ *
+ * A file that's created or removed changes the mtime, size or link count of
+ * its directory. A file that grows in place doesn't, but the rows that made
+ * it grow show up in the database's tuple counters in pgstat, once the
+ * transaction that wrote them has ended. PostgreSQL 11 has no counter of
+ * relation extensions, so to catch a long transaction that keeps extending
+ * existing segments, the WAL insert position is compared too. It's free to
+ * read, and moves with every WAL-logged write, although in any database of
+ * the cluster. On a hot standby, where nothing is written locally, the
+ * replay position stands in for those.
+ *
+ * Returns true if anything may have changed. The first probe always does.
+ */
+static bool
+ProbeChanged(List *dirs)
+{
+	ProbeSignature sig;
+	PgStat_StatDBEntry *dbentry;
+	TimestampTz now = GetCurrentTimestamp();
+	ListCell   *lc;
+	bool		changed;
+
+	memset(&sig, 0, sizeof(sig));
+	foreach(lc, dirs)
+	{
+		struct stat st;
+
+		if (stat((char *) lfirst(lc), &st) != 0)
+			continue;
+		sig.ndirs++;
+		sig.max_mtime = Max(sig.max_mtime, st.st_mtime);
+		sig.nlinks += st.st_nlink;
+		sig.dirsize += st.st_size;
+	}
+
+	/* Get fresh counters, not the snapshot from the previous probe */
+	pgstat_clear_snapshot();
+	dbentry = pgstat_fetch_stat_dbentry(MyDatabaseId);
+	if (dbentry)
+		sig.tuples_changed = dbentry->n_tuples_inserted +
+			dbentry->n_tuples_updated +
+			dbentry->n_tuples_deleted;
+	pgstat_clear_snapshot();
+
+	if (RecoveryInProgress())
+		sig.replay_lsn = GetXLogReplayRecPtr(NULL);
+	else
+		sig.insert_lsn = GetXLogInsertRecPtr();
+
+	/*
+	 * mtimes have a resolution of one second, so a directory that was
+	 * modified in the same second as the previous probe may have been
+	 * modified again after it.
+	 */
+	changed = (last_probe_time == 0 ||
+			   sig.ndirs != last_probe.ndirs ||
+			   sig.max_mtime != last_probe.max_mtime ||
+			   sig.nlinks != last_probe.nlinks ||
+			   sig.dirsize != last_probe.dirsize ||
+			   sig.tuples_changed != last_probe.tuples_changed ||
+			   sig.insert_lsn != last_probe.insert_lsn ||
+			   sig.replay_lsn != last_probe.replay_lsn ||
+			   sig.max_mtime >= timestamptz_to_time_t(last_probe_time));
+
+	last_probe = sig;
+	last_probe_time = now;
+
+	return changed;
+}
+
+/*
+ * Scan file system, to update the model with all files.
+ *
+ * If 'probe' is set, probe for changes first, and unless 'force' is also
+ * set, skip the scan if there were none, and only refresh the usage of
+ * temporary files. Returns true if the model was rescanned.
+ */
+bool
+refresh_fs_model(int scan_workers, bool probe, bool force)
+{
+	instr_time	sweep_start;
+	instr_time	duration;
+	List	   *dirs;
+	ListCell   *lc;
+
+	dirs = CollectScanDirs();
+
+	/* Probe even when forced, to have a baseline for the next cycle */
+	if (probe && !ProbeChanged(dirs) && !force)
+	{
+		list_free_deep(dirs);
+
+		RefreshTempUsage();
+		UpdateUsageHistory();
+
+		curstats.skipped_scans++;
+		LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+		MyDbState->scanstats.skipped_scans = curstats.skipped_scans;
+		LWLockRelease(shared->lock);
+
+		return false;
+	}
+
+	/* Start collecting statistics for a new cycle */
+	INSTR_TIME_SET_CURRENT(cycle_start);
+	prev_scan_start_time = scan_start_time;
+	scan_start_time = GetCurrentTimestamp();
+	curstats.dirs_scanned = 0;
+	curstats.stat_calls = 0;
+	curprogress.files_done = 0;
+	curprogress.bytes_done = 0;
+	curprogress.orphans_remaining = 0;
+
+	/*
+	 * Bump the generation counter first, so that we can detect removed files.
+	 */
+	generation++;
+
+	/* The previous cycle's file count is our best guess of the total */
+	curprogress.dirs_total = list_length(dirs);
+	curprogress.files_total = curstats.files;
+	SetScanPhase(SCAN_PHASE_SCANNING);
+
+	/*
+	 * Scan them, with helpers if enabled. Whatever the helpers didn't scan,
+	 * because they couldn't be launched or failed, is scanned here.
+	 */
+	if (scan_workers > 0)
+	{
+		List	   *unfinished;
+
+		unfinished = ParallelScanDirs(dirs, scan_workers, UpdateFileSize,
+									  &curstats.dirs_scanned,
+									  &curstats.stat_calls);
+		if (unfinished != dirs)
+		{
+			list_free_deep(dirs);
+			dirs = unfinished;
+		}
+	}
+	foreach(lc, dirs)
+		RebuildRelSizeMapDir((char *) lfirst(lc));
+	list_free_deep(dirs);
+
+	SetScanPhase(SCAN_PHASE_SWEEPING);
+
+	/*
+	 * Finally, remove files that no longer exist.
+	 */
+	INSTR_TIME_SET_CURRENT(sweep_start);
+	duration = sweep_start;
+	INSTR_TIME_SUBTRACT(duration, cycle_start);
+	curstats.scan_time = INSTR_TIME_GET_MILLISEC(duration);
+
+	SweepRemovedFiles();
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, sweep_start);
+	curstats.sweep_time = INSTR_TIME_GET_MILLISEC(duration);
+
+	/*
+	 * Temporary files are not part of the model. Recompute their totals from
+	 * scratch.
+	 */
+	RefreshTempUsage();
+
+	UpdateUsageHistory();
+
+	return true;
+}
+
+/*
+ * Record the totals of the roles in this database in their history rings,
+ * and update their growth rate estimates, after a scan.
+ *
+ * The rate is an exponentially weighted moving average, so that a burst of
+ * writes raises it quickly, but it decays over a minute or so once the
+ * writes stop. The weight of the new sample depends on how long it's been
+ * since the previous one, so that the estimate doesn't depend on
+ * pg_quota.refresh_naptime.
+ */
+static void
+UpdateUsageHistory(void)
+{
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
+	TimestampTz now = GetCurrentTimestamp();
+	dsa_area   *area = get_quota_area(true);
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		long		secs;
+		int			usecs;
+		double		elapsed;
+		double		rate;
+		double		weight;
+
+		if (qentry->key.kind != QUOTA_ROLE ||
+			qentry->key.dbid != MyDatabaseId)
+			continue;
+
+		/* If there's no memory for the history, just go without */
+		if (!DsaPointerIsValid(qentry->history))
+			qentry->history = dsa_allocate_extended(area, sizeof(UsageHistory),
+													DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+		if (DsaPointerIsValid(qentry->history))
+		{
+			UsageHistory *history = dsa_get_address(area, qentry->history);
+
+			history->samples[history->next].time = now;
+			history->samples[history->next].size = qentry->totalsize;
+			history->next = (history->next + 1) % USAGE_HISTORY_SIZE;
+			if (history->count < USAGE_HISTORY_SIZE)
+				history->count++;
+		}
+
+		if (qentry->rate_time == 0)
+		{
+			/* First scan that saw this role. Nothing to compare with yet. */
+			qentry->rate_size = qentry->totalsize;
+			qentry->rate_time = now;
+			continue;
+		}
+
+		TimestampDifference(qentry->rate_time, now, &secs, &usecs);
+		elapsed = secs + usecs / 1000000.0;
+		if (elapsed <= 0)
+			continue;
+
+		rate = (qentry->totalsize - qentry->rate_size) / elapsed;
+		weight = 1.0 - exp(-elapsed / GROWTH_RATE_WINDOW);
+		qentry->growth_rate += weight * (rate - qentry->growth_rate);
+
+		qentry->rate_size = qentry->totalsize;
+		qentry->rate_time = now;
+	}
+
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Update the owner of a relation in the model.
+ */
+void
+UpdateRelOwner(RelFileNode *rnode, Oid owner)
+{
+	RelSizeEntry *relentry;
+	bool		found;
+
+	relentry = (RelSizeEntry *) hash_search(relfilenode_to_relentry_map,
+											(void *) rnode,
+											HASH_FIND, &found);
+	if (!found)
+		return;
+
+	if (relentry->owner == owner)
+		return;
+
+	/*
+	 * Move the size from the old owner's totals to the new owner's, creating
+	 * the new entries if they don't exist yet.
+	 */
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	AddToTotals(relentry, -relentry->totalsize);
+	AddToCounts(relentry, -1, -relentry->numfiles);
+	if (relentry->owner == InvalidOid)
+		dlist_delete(&relentry->orphan_node);
+
+	relentry->owner = owner;
+
+	AddToTotals(relentry, relentry->totalsize);
+	AddToCounts(relentry, 1, relentry->numfiles);
+	if (relentry->owner == InvalidOid)
+		dlist_push_head(&orphanRels, &relentry->orphan_node);
+
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Update the quotas for a role, schema or tablespace.
+ *
+ * This update the quota fields in the in-memory model. This is used when the
+ * quotas are loaded from the cofiguration tables. Call BeginQuotaUpdate()
+ * before loading the tables, and EndQuotaUpdate() after, to reset the quotas
+ * that have been removed from the tables.
+ */
+void
+BeginQuotaUpdate(void)
+{
+	quota_generation++;
+}
+
+void
+UpdateQuota(QuotaKind kind, Oid objid, QuotaLimits *limits)
+{
+	QuotaEntry *qentry;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	if (kind == QUOTA_CLUSTER)
+	{
+		/* This database's say on the role's cluster-wide quota */
+		qentry = EnterQuotaEntry(QUOTA_ROLE, objid);
+		if (qentry)
+		{
+			qentry->cluster_quota = limits->quota;
+			qentry->cluster_quota_generation = quota_generation;
+		}
+	}
+	else if ((qentry = EnterQuotaEntry(kind, objid)) != NULL)
+	{
+		qentry->quota = limits->quota;
+		qentry->temp_quota = limits->temp_quota;
+		qentry->max_relations = limits->max_relations;
+		qentry->max_files = limits->max_files;
+		qentry->quota_generation = quota_generation;
+	}
+
+	LWLockRelease(shared->lock);
+}
+
+void
+EndQuotaUpdate(void)
+{
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (qentry->key.dbid != MyDatabaseId)
+			continue;
+		if (qentry->quota_generation != quota_generation)
+		{
+			qentry->quota = -1;
+			qentry->temp_quota = -1;
+			qentry->max_relations = -1;
+			qentry->max_files = -1;
+		}
+		if (qentry->cluster_quota_generation != quota_generation)
+			qentry->cluster_quota = -1;
+	}
+
+	RecomputeClusterQuotas();
+
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Recompute the cluster-wide quotas from the settings of each database. If
+ * the databases disagree, the smallest quota wins. Caller must hold
+ * shared->lock in exclusive mode.
+ */
+static void
+RecomputeClusterQuotas(void)
+{
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (qentry->key.dbid == InvalidOid && qentry->key.kind == QUOTA_ROLE)
+			qentry->quota = -1;
+	}
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		QuotaEntry *clusterentry;
+
+		if (qentry->key.dbid == InvalidOid || qentry->cluster_quota < 0)
+			continue;
+
+		clusterentry = FindQuotaEntryForDb(QUOTA_ROLE, qentry->key.objid,
+										   InvalidOid);
+		if (clusterentry &&
+			(clusterentry->quota < 0 ||
+			 qentry->cluster_quota < clusterentry->quota))
+			clusterentry->quota = qentry->cluster_quota;
+	}
+}
+
+/*
+ * Rebuild role_to_groups_map, for the given list of groups with quotas, and
+ * recompute the group totals from the role totals.
+ */
+static void
+RebuildGroupMembership(List *groups)
+{
+	HASHCTL		hash_ctl;
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
+	RoleGroupsEntry *rgentry;
+	MemoryContext oldcontext;
+	ListCell   *lc;
+
+	MemoryContextReset(GroupContext);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RoleGroupsEntry);
+	hash_ctl.hcxt = GroupContext;
+
+	role_to_groups_map = hash_create("role to RoleGroupsEntry map",
+									 64,
+									 &hash_ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	oldcontext = MemoryContextSwitchTo(GroupContext);
+	quotaGroups = list_copy(groups);
+	MemoryContextSwitchTo(oldcontext);
+
+	foreach(lc, groups)
+	{
+		Oid			groupid = lfirst_oid(lc);
+		List	   *members;
+		ListCell   *lc2;
+
+		members = get_role_members(groupid);
+		foreach(lc2, members)
+		{
+			Oid			member = lfirst_oid(lc2);
+			bool		found;
+
+			rgentry = (RoleGroupsEntry *) hash_search(role_to_groups_map,
+													  (void *) &member,
+													  HASH_ENTER, &found);
+			if (!found)
+				rgentry->groups = NIL;
+
+			oldcontext = MemoryContextSwitchTo(GroupContext);
+			rgentry->groups = lappend_oid(rgentry->groups, groupid);
+			MemoryContextSwitchTo(oldcontext);
+		}
+		list_free(members);
+	}
+
+	/* Recompute the group totals from scratch. */
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (qentry->key.dbid == MyDatabaseId &&
+			qentry->key.kind == QUOTA_GROUP)
+			qentry->totalsize = 0;
+	}
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (qentry->key.dbid != MyDatabaseId ||
+			qentry->key.kind != QUOTA_ROLE ||
+			qentry->totalsize == 0)
+			continue;
+
+		rgentry = (RoleGroupsEntry *) hash_search(role_to_groups_map,
+												  (void *) &qentry->key.objid,
+												  HASH_FIND, NULL);
+		if (rgentry)
+		{
+			foreach(lc, rgentry->groups)
+			{
+				QuotaEntry *gentry = FindQuotaEntry(QUOTA_GROUP, lfirst_oid(lc));
+
+				/* all groups in the list have a quota, hence an entry */
+				if (gentry)
+					gentry->totalsize += qentry->totalsize;
+			}
+		}
+	}
+
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Update group quota state, after loading the quotas.
+ *
+ * Rebuilds the group membership closure if 'membership_changed' is set, or
+ * if the set of groups with quotas has changed. Then sets the flag in each
+ * role's entry, that tells backends whether any of its groups is over quota.
+ */
+void
+UpdateGroupQuotas(bool membership_changed)
+{
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
+	List	   *groups = NIL;
+	ListCell   *lc;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (qentry->key.dbid == MyDatabaseId &&
+			qentry->key.kind == QUOTA_GROUP &&
+			qentry->quota >= 0)
+			groups = lappend_oid(groups, qentry->key.objid);
+	}
+	LWLockRelease(shared->lock);
+
+	if (!membership_changed)
+	{
+		if (list_length(groups) != list_length(quotaGroups))
+			membership_changed = true;
+		else
+		{
+			foreach(lc, groups)
+			{
+				if (!list_member_oid(quotaGroups, lfirst_oid(lc)))
+				{
+					membership_changed = true;
+					break;
+				}
+			}
+		}
+	}
+
+	if (membership_changed)
+		RebuildGroupMembership(groups);
+
+	/* Set the flags. */
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		RoleGroupsEntry *rgentry;
+		bool		exceeded = false;
+
+		if (qentry->key.dbid != MyDatabaseId ||
+			qentry->key.kind != QUOTA_ROLE)
+			continue;
+
+		if (role_to_groups_map == NULL)
+			rgentry = NULL;
+		else
+			rgentry = (RoleGroupsEntry *) hash_search(role_to_groups_map,
+													  (void *) &qentry->key.objid,
+													  HASH_FIND, NULL);
+		if (rgentry)
+		{
+			foreach(lc, rgentry->groups)
+			{
+				QuotaEntry *gentry = FindQuotaEntry(QUOTA_GROUP, lfirst_oid(lc));
+
+				if (gentry && gentry->quota >= 0 &&
+					gentry->totalsize > gentry->quota)
+				{
+					exceeded = true;
+					break;
+				}
+			}
+		}
+		qentry->group_exceeded = exceeded;
+	}
+	LWLockRelease(shared->lock);
+
+	list_free(groups);
+}
+
+/*
+ * Scan the list of relations that without owner information, and get their
+ * owners.
+ */
+void
+UpdateOrphans(void)
+{
+	dlist_iter	iter;
+	RelSizeEntry **orphans;
+	RelFileInfo *infos;
+	bool	   *registered;
+	int			norphans;
+	int			i;
+	instr_time	start;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	norphans = 0;
+	dlist_foreach(iter, &orphanRels)
+		norphans++;
+	curprogress.orphans_remaining = norphans;
+	ReportProgress();
+
+	/*
+	 * Collect the orphans into an array first, because UpdateRelOwner()
+	 * unlinks them from the list.
+	 */
+	orphans = (RelSizeEntry **)
+		palloc_extended(norphans * sizeof(RelSizeEntry *), MCXT_ALLOC_HUGE);
+	infos = (RelFileInfo *)
+		palloc_extended(norphans * sizeof(RelFileInfo), MCXT_ALLOC_HUGE);
+	registered = (bool *) palloc_extended(norphans * sizeof(bool), MCXT_ALLOC_HUGE);
+	i = 0;
+	dlist_foreach(iter, &orphanRels)
+		orphans[i++] = dlist_container(RelSizeEntry, orphan_node, iter.cur);
+
+	/*
+	 * If the backend that created the relfilenode registered it, we already
+	 * know the owner, even if the creating transaction hasn't committed yet.
+	 */
+	TakePendingRelFileNodes(orphans, norphans, infos, registered);
+
+	for (i = 0; i < norphans; i++)
+	{
+		RelSizeEntry *relentry = orphans[i];
+		RelFileInfo *info = &infos[i];
+
+		if (--curprogress.orphans_remaining % PROGRESS_REPORT_INTERVAL == 0)
+			ReportProgress();
+
+		if (registered[i] ||
+			get_relfilenode_info(&relentry->rnode, info))
+		{
+			relentry->relid = info->relid;
+			relentry->namespace = info->namespace;
+			relentry->toprelid = info->toprelid;
+			relentry->kind = info->kind;
+
+			UpdateRelOwner(&relentry->rnode, info->owner);
+
+			elog(DEBUG1, "updated owner of relation %u/%u/%u to %u",
+				 relentry->rnode.dbNode, relentry->rnode.spcNode, relentry->rnode.relNode, info->owner);
+		}
+	}
+
+	pfree(orphans);
+	pfree(infos);
+	pfree(registered);
+
+	PurgePendingRelFileNodes();
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	curstats.orphans_time = INSTR_TIME_GET_MILLISEC(duration);
+}
+
+/*
+ * Physical block number of the FSM leaf page with logical number 'logpageno',
+ * like fsm_logical_to_physical() in freespace.c. The pages of the tree are
+ * stored depth-first, so each leaf page is preceded by the upper-level pages
+ * that lead to it.
+ */
+static BlockNumber
+fsm_leaf_block(BlockNumber logpageno)
+{
+	BlockNumber pages = 0;
+	BlockNumber leafno = logpageno;
+	int			l;
+
+	for (l = 0; l < FSM_TREE_DEPTH; l++)
+	{
+		pages += leafno + 1;
+		leafno /= SlotsPerFSMPage;
+	}
+	return pages - 1;
+}
+
+/*
+ * Sum up the free space recorded in the FSM of a relation, in bytes.
+ *
+ * Only the leaf pages are read; the upper levels just hold the maximum of
+ * their children. Returns -1 if the relation is locked, or gone, or has been
+ * given a new relfilenode since the model last saw it.
+ */
+static int64
+ReadFreeSpaceMap(RelSizeEntry *relentry, BufferAccessStrategy strategy)
+{
+	Relation	rel;
+	BlockNumber nblocks;
+	BlockNumber logpageno;
+	BlockNumber blkno;
+	int64		categories = 0;
+
+	/* Don't wait behind a DROP or TRUNCATE, we'll try again next cycle */
+	if (!ConditionalLockRelationOid(relentry->relid, AccessShareLock))
+		return -1;
+
+	rel = try_relation_open(relentry->relid, NoLock);
+	if (rel == NULL)
+	{
+		UnlockRelationOid(relentry->relid, AccessShareLock);
+		return -1;
+	}
+	if (rel->rd_node.relNode != relentry->rnode.relNode)
+	{
+		relation_close(rel, AccessShareLock);
+		return -1;
+	}
+
+	RelationOpenSmgr(rel);
+	if (smgrexists(rel->rd_smgr, FSM_FORKNUM))
+	{
+		nblocks = RelationGetNumberOfBlocksInFork(rel, FSM_FORKNUM);
+
+		for (logpageno = 0; (blkno = fsm_leaf_block(logpageno)) < nblocks; logpageno++)
+		{
+			Buffer		buf;
+			FSMPage		fsmpage;
+			int			slot;
+
+			CHECK_FOR_INTERRUPTS();
+
+			buf = ReadBufferExtended(rel, FSM_FORKNUM, blkno, RBM_ZERO_ON_ERROR,
+									 strategy);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			fsmpage = (FSMPage) PageGetContents(BufferGetPage(buf));
+			for (slot = NonLeafNodesPerPage; slot < NodesPerPage; slot++)
+				categories += fsmpage->fp_nodes[slot];
+			UnlockReleaseBuffer(buf);
+		}
+	}
+
+	relation_close(rel, AccessShareLock);
+
+	return categories * FSM_CAT_STEP;
+}
+
+/* Reclaimable space of one role, in UpdateReclaimableSpace() */
+typedef struct ReclaimableTotals
+{
+	Oid			owner;			/* hash key */
+	int64		reclaimable;
+	int64		free_space;
+} ReclaimableTotals;
+
+/*
+ * Estimate how much of the space used by each role could be reused without
+ * growing its relations.
+ *
+ * Two sources are summed up per relation: the free space that VACUUM has
+ * recorded in the free space map, and the share of the relation's size that
+ * pgstat's count of dead tuples makes up, which the next VACUUM would free.
+ * Both are estimates: the FSM is only a hint, and is not updated between
+ * vacuums, and dead tuples are assumed to be the same size as live ones.
+ *
+ * Reading the FSMs is cheap, one page per ~4000 heap pages, but it opens
+ * each relation, so it's only done for tables and TOAST tables whose pgstat
+ * counters or size have changed since the previous estimate, and the caller
+ * only calls this every pg_quota.reclaimable_interval.
+ *
+ * Must be called in a transaction.
+ */
+void
+UpdateReclaimableSpace(void)
+{
+	HASHCTL		hash_ctl;
+	HTAB	   *totals;
+	HASH_SEQ_STATUS iter;
+	RelSizeEntry *relentry;
+	ReclaimableTotals *rtotals;
+	BufferAccessStrategy strategy;
+	dlist_iter	db_iter;
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(ReclaimableTotals);
+	hash_ctl.hcxt = CurrentMemoryContext;
+	totals = hash_create("pg_quota reclaimable totals", 64, &hash_ctl,
+						 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+
+	/* Get fresh counters, not a snapshot from earlier in this transaction */
+	pgstat_clear_snapshot();
+
+	hash_seq_init(&iter, relfilenode_to_relentry_map);
+	while ((relentry = hash_seq_search(&iter)) != NULL)
+	{
+		PgStat_StatTabEntry *tabentry;
+		int64		changes = 0;
+		bool		found;
+
+		/* Not resolved from the catalogs yet */
+		if (!OidIsValid(relentry->owner) || !OidIsValid(relentry->relid))
+			continue;
+
+		/*
+		 * Free index pages can only be reused by the same index, and pgstat
+		 * doesn't count dead index tuples, so indexes aren't estimated.
+		 */
+		if (relentry->kind == RELSIZE_INDEX)
+			continue;
+
+		tabentry = pgstat_fetch_stat_tabentry(relentry->relid);
+		if (tabentry)
+			changes = tabentry->tuples_inserted +
+				tabentry->tuples_updated +
+				tabentry->tuples_deleted +
+				tabentry->vacuum_count +
+				tabentry->autovac_vacuum_count;
+
+		if (changes != relentry->reclaim_changes ||
+			relentry->totalsize != relentry->reclaim_size)
+		{
+			int64		free_bytes;
+
+			free_bytes = ReadFreeSpaceMap(relentry, strategy);
+			if (free_bytes >= 0)
+			{
+				relentry->free_bytes = Min(free_bytes, (int64) relentry->totalsize);
+				relentry->dead_bytes = 0;
+				if (tabentry && tabentry->n_dead_tuples > 0)
+				{
+					double		dead_fraction;
+
+					dead_fraction = (double) tabentry->n_dead_tuples /
+						(tabentry->n_live_tuples + tabentry->n_dead_tuples);
+					relentry->dead_bytes = Min((int64) (relentry->totalsize * dead_fraction),
+											   relentry->totalsize - relentry->free_bytes);
+				}
+				relentry->reclaim_changes = changes;
+				relentry->reclaim_size = relentry->totalsize;
+			}
+		}
+
+		if (relentry->free_bytes == 0 && relentry->dead_bytes == 0)
+			continue;
+
+		rtotals = (ReclaimableTotals *) hash_search(totals,
+													(void *) &relentry->owner,
+													HASH_ENTER, &found);
+		if (!found)
+		{
+			rtotals->reclaimable = 0;
+			rtotals->free_space = 0;
+		}
+		rtotals->reclaimable += relentry->free_bytes + relentry->dead_bytes;
+
+		/*
+		 * Free pages of TOAST tables can't take new rows of the table, so
+		 * they don't count towards the headroom.
+		 */
+		if (relentry->kind == RELSIZE_TABLE)
+			rtotals->free_space += relentry->free_bytes;
+	}
+
+	pgstat_clear_snapshot();
+	FreeAccessStrategy(strategy);
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	dlist_foreach(db_iter, &MyDbState->entries)
+	{
+		QuotaEntry *qentry = dlist_container(QuotaEntry, db_node, db_iter.cur);
+
+		qentry->reclaimable = 0;
+		qentry->free_space = 0;
+	}
+	hash_seq_init(&iter, totals);
+	while ((rtotals = hash_seq_search(&iter)) != NULL)
+	{
+		QuotaEntry *qentry = FindQuotaEntry(QUOTA_ROLE, rtotals->owner);
+
+		if (qentry)
+		{
+			qentry->reclaimable = rtotals->reclaimable;
+			qentry->free_space = rtotals->free_space;
+		}
+	}
+	LWLockRelease(shared->lock);
+
+	hash_destroy(totals);
+}
+
+/*
+ * Is there a quota.verify() request waiting for this worker?
+ */
+bool
+VerifyRequested(void)
+{
+	bool		result;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	result = MyDbState->verify_requested != MyDbState->verify_completed;
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * Tell backends whether the worker is hibernating. Returns the previous
+ * value, so that after a sleep, the worker can tell if a backend cleared it.
+ */
+bool
+SetHibernating(bool hibernating)
+{
+	bool		result;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	result = MyDbState->hibernating;
+	MyDbState->hibernating = hibernating;
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * Wake up the worker of this database, if it's hibernating. Called by
+ * backends before they write to a table.
+ */
+void
+WakeIdleWorker(void)
+{
+	static pg_quota_db_state *dbstate = NULL;
+
+	if (!shared)
+		return;
+
+	if (dbstate == NULL)
+	{
+		LWLockAcquire(shared->lock, LW_SHARED);
+		dbstate = get_db_state(MyDatabaseId);
+		LWLockRelease(shared->lock);
+		if (dbstate == NULL)
+			return;
+	}
+
+	/* Unlocked peek first, to keep this cheap when the worker is awake */
+	if (!dbstate->hibernating)
+		return;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	if (dbstate->hibernating && dbstate->worker_latch)
+	{
+		dbstate->hibernating = false;
+		SetLatch(dbstate->worker_latch);
+	}
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Find or create the VerifyResult for a role, in VerifyModel().
+ */
+static VerifyResult *
+verify_result_for(HTAB *results, Oid rolid)
+{
+	VerifyResult *result;
+	bool		found;
+
+	result = (VerifyResult *) hash_search(results, (void *) &rolid,
+										  HASH_ENTER, &found);
+	if (!found)
+	{
+		memset(result, 0, sizeof(VerifyResult));
+		result->rolid = rolid;
+	}
+	return result;
+}
+
+/*
+ * Audit the model against the data directory and the catalogs, for
+ * quota.verify().
+ *
+ * A random sample of the files in the model is stat()ed again, and the
+ * owners of their relations are looked up again in pg_class. Any file that
+ * is gone, has a different size, or belongs to a relation whose owner has
+ * changed, is counted as a discrepancy, against the role that the model
+ * attributes it to. The bytes that the model counts wrong are added to the
+ * error of that role, and in the case of a wrong owner, also of the real
+ * owner. If the request asked for it, the discrepancies are fixed in the
+ * model too, like the next full scan would.
+ *
+ * Relations whose owner is not known yet are left alone; UpdateOrphans()
+ * looks them up anyway on every cycle. So are relfilenodes that are not in
+ * pg_class, as long as the file exists, see below.
+ *
+ * Must be called in a transaction.
+ */
+void
+VerifyModel(void)
+{
+	HASHCTL		hash_ctl;
+	HTAB	   *results;
+	HASH_SEQ_STATUS iter;
+	FileSizeEntry *fsentry;
+	VerifyResult *result;
+	uint64		request;
+	double		fraction;
+	bool		repair;
+	dsa_area   *area = get_quota_area(true);
+	dsa_pointer newp;
+	dsa_pointer oldp;
+	VerifyResult *newresults;
+	int			nresults;
+	int			i;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	request = MyDbState->verify_requested;
+	fraction = MyDbState->verify_fraction;
+	repair = MyDbState->verify_repair;
+	LWLockRelease(shared->lock);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(VerifyResult);
+	hash_ctl.hcxt = CurrentMemoryContext;
+	results = hash_create("pg_quota verify results", 64, &hash_ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/*
+	 * The repairs don't add any files to path_to_fsentry_map, and only
+	 * remove the current one, which is allowed during the scan.
+	 */
+	hash_seq_init(&iter, path_to_fsentry_map);
+	while ((fsentry = hash_seq_search(&iter)) != NULL)
+	{
+		RelSizeEntry *relentry = fsentry->parent;
+		struct stat statbuf;
+		RelFileInfo info;
+
+		if ((double) random() / MAX_RANDOM_VALUE >= fraction)
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		result = verify_result_for(results, relentry->owner);
+		result->sampled_files++;
+		result->sampled_bytes += fsentry->filesize;
+
+		if (stat(fsentry->path, &statbuf) != 0)
+		{
+			if (errno != ENOENT)
+			{
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("could not stat file \"%s\": %m", fsentry->path)));
+				continue;
+			}
+
+			/* We missed the deletion of this file */
+			result->missing_files++;
+			result->error_bytes += fsentry->filesize;
+			if (repair)
+				RemoveFileSize(fsentry);
+			continue;
+		}
+
+		if (statbuf.st_size != fsentry->filesize)
+		{
+			result->size_mismatches++;
+			result->error_bytes += Abs(statbuf.st_size - fsentry->filesize);
+			if (repair)
+				UpdateFileSize(&relentry->rnode, fsentry->path, statbuf.st_size);
+		}
+
+		if (!OidIsValid(relentry->owner))
+			continue;
+
+		/*
+		 * If the relfilenode is not in pg_class, but the file is still
+		 * there, the result is inconclusive. The relation may have been
+		 * dropped, but it may just as well have been created, or rewritten,
+		 * by a transaction that hasn't committed yet, and registered its
+		 * owner with RegisterRelFileNode(). Taking the owner away would
+		 * make it an orphan again, which isn't counted against any quota
+		 * until the transaction commits. If the file is gone, the stat()
+		 * above already counted it.
+		 */
+		if (!get_relfilenode_info(&relentry->rnode, &info))
+			continue;
+		if (info.owner == relentry->owner &&
+			info.namespace == relentry->namespace)
+			continue;
+
+		result->owner_mismatches++;
+		result->error_bytes += fsentry->filesize;
+		if (info.owner != relentry->owner)
+			verify_result_for(results, info.owner)->error_bytes += fsentry->filesize;
+
+		if (repair)
+		{
+			/*
+			 * Take the relation's size out of its old owner's, and schema's,
+			 * totals, and add it to the new ones.
+			 */
+			UpdateRelOwner(&relentry->rnode, InvalidOid);
+			relentry->relid = info.relid;
+			relentry->namespace = info.namespace;
+			relentry->toprelid = info.toprelid;
+			relentry->kind = info.kind;
+			UpdateRelOwner(&relentry->rnode, info.owner);
+		}
+	}
+
+	/* Publish the results, and wake up the backends waiting for them */
+	nresults = hash_get_num_entries(results);
+	if (nresults > 0)
+	{
+		newp = dsa_allocate(area, nresults * sizeof(VerifyResult));
+		newresults = (VerifyResult *) dsa_get_address(area, newp);
+
+		i = 0;
+		hash_seq_init(&iter, results);
+		while ((result = hash_seq_search(&iter)) != NULL)
+		{
+			result->estimated_error_bytes = (int64) (result->error_bytes / fraction);
+			newresults[i++] = *result;
+		}
+	}
+	else
+		newp = InvalidDsaPointer;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	oldp = MyDbState->verify_results;
+	MyDbState->verify_results = newp;
+	MyDbState->nverify_results = nresults;
+	MyDbState->verify_completed = request;
+	LWLockRelease(shared->lock);
+
+	/* Backends copy the results while holding the lock, so this is safe */
+	if (DsaPointerIsValid(oldp))
+		dsa_free(area, oldp);
+
+	ConditionVariableBroadcast(&MyDbState->verify_cv);
+
+	hash_destroy(results);
+
+	elog(DEBUG1, "verified %.0f%% of the model%s", fraction * 100,
+		 repair ? ", with repair" : "");
+}
+
+/*
+ * Register the owner of a new relfilenode, for UpdateOrphans(). Called by
+ * backends, when they create a relation, or give one a new relfilenode.
+ */
+void
+RegisterRelFileNode(RelFileNode *rnode, RelFileInfo *info)
+{
+	PendingRelFileNode *pending;
+
+	if (!pending_relfilenode_map)
+		return;
+
+	LWLockAcquire(shared->pending_lock, LW_EXCLUSIVE);
+
+	/* If the map is full, the worker will find the owner the slow way */
+	pending = (PendingRelFileNode *) hash_search(pending_relfilenode_map,
+												 (void *) rnode,
+												 HASH_ENTER_NULL, NULL);
+	if (pending)
+	{
+		pending->info = *info;
+		pending->registered = GetCurrentTimestamp();
+	}
+
+	LWLockRelease(shared->pending_lock);
+
+	if (!pending)
+		elog(DEBUG1, "could not register relfilenode %u/%u/%u, the map is full",
+			 rnode->spcNode, rnode->dbNode, rnode->relNode);
+}
+
+/*
+ * Look up, and remove, the relfilenodes of the given orphans that were
+ * registered with RegisterRelFileNode(). found[i] is set if orphans[i] was,
+ * and its information is returned in infos[i].
+ *
+ * All the orphans are looked up with one acquisition of the lock. There can
+ * be hundreds of thousands of them, after a restart.
+ */
+static void
+TakePendingRelFileNodes(RelSizeEntry **orphans, int norphans,
+						RelFileInfo *infos, bool *found)
+{
+	int			i;
+
+	memset(found, 0, norphans * sizeof(bool));
+
+	LWLockAcquire(shared->pending_lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < norphans && hash_get_num_entries(pending_relfilenode_map) > 0; i++)
+	{
+		RelFileNode *rnode = &orphans[i]->rnode;
+		PendingRelFileNode *pending;
+
+		pending = (PendingRelFileNode *) hash_search(pending_relfilenode_map,
+													 (void *) rnode,
+													 HASH_FIND, NULL);
+		if (pending)
+		{
+			found[i] = true;
+			infos[i] = pending->info;
+			(void) hash_search(pending_relfilenode_map, (void *) rnode,
+							   HASH_REMOVE, NULL);
+		}
+	}
+
+	LWLockRelease(shared->pending_lock);
+}
+
+/*
+ * Remove the registered relfilenodes of this database that are older than
+ * the previous scan. Their files existed when they were registered, so if
+ * neither scan saw them, they've been removed since.
+ */
+static void
+PurgePendingRelFileNodes(void)
+{
+	HASH_SEQ_STATUS iter;
+	PendingRelFileNode *pending;
+
+	if (prev_scan_start_time == 0)
+		return;
+
+	LWLockAcquire(shared->pending_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&iter, pending_relfilenode_map);
+	while ((pending = hash_seq_search(&iter)) != NULL)
+	{
+		if (pending->rnode.dbNode == MyDatabaseId &&
+			pending->registered < prev_scan_start_time)
+			(void) hash_search(pending_relfilenode_map,
+							   (void *) &pending->rnode,
+							   HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(shared->pending_lock);
+}
+
+/*
+ * A threshold crossing, found by NotifyThresholdCrossings().
+ */
+typedef struct
+{
+	QuotaKind	kind;
+	Oid			objid;
+	int			threshold;
+	bool		up;
+	int64		totalsize;
+	int64		quota;
+} ThresholdCrossing;
+
+/*
+ * Return the name of the object that a quota is set on, for messages.
+ */
+static const char *
+quota_kind_name(QuotaKind kind)
+{
+	switch (kind)
+	{
+		case QUOTA_ROLE:
+			return "role";
+		case QUOTA_GROUP:
+			return "group";
+		case QUOTA_CLUSTER:
+			return "cluster";
+		case QUOTA_NAMESPACE:
+			return "schema";
+		case QUOTA_TABLESPACE:
+			return "tablespace";
+		case QUOTA_DATABASE:
+			return "database";
+	}
+	return "unknown";
+}
+
+static char *
+quota_object_name(QuotaKind kind, Oid objid)
+{
+	char	   *name = NULL;
+
+	switch (kind)
+	{
+		case QUOTA_ROLE:
+		case QUOTA_GROUP:
+		case QUOTA_CLUSTER:
+			name = GetUserNameFromId(objid, true);
+			break;
+		case QUOTA_NAMESPACE:
+			name = get_namespace_name(objid);
+			break;
+		case QUOTA_TABLESPACE:
+			name = get_tablespace_name(objid);
+			break;
+		case QUOTA_DATABASE:
+			name = get_database_name(objid);
+			break;
+	}
+	if (name == NULL)
+		name = psprintf("%u", objid);
+	return name;
+}
+
+/*
+ * Check the totals of this database against the notification thresholds,
+ * and send a notification on the "pg_quota" channel, and write a line to the
+ * log, for each one that has been crossed since the last call.
+ *
+ * The cluster-wide totals are checked by one worker only: the one for the
+ * first database in pg_quota.databases that has a worker running. The
+ * notifications about them are sent in that database.
+ *
+ * 'thresholds' is a list of percentages of the quota, in ascending order.
+ * Each quota remembers the highest threshold it has crossed, and only
+ * moving to a different one is reported. Going down, usage must fall
+ * NOTIFY_HYSTERESIS percentage points below the threshold, so that a total
+ * hovering around a threshold doesn't produce a stream of notifications.
+ *
+ * The notifications are sent when the current transaction commits. On a
+ * hot standby, NOTIFY is not possible, so the crossings are only logged.
+ */
+void
+NotifyThresholdCrossings(List *thresholds)
+{
+	HASH_SEQ_STATUS iter;
+	QuotaEntry *qentry;
+	ThresholdCrossing *crossings;
+	int			ncrossings = 0;
+	int			maxcrossings;
+	bool		cluster_notifier = false;
+	int			i;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < shared->num_databases; i++)
+	{
+		if (shared->databases[i].worker_latch != NULL)
+		{
+			cluster_notifier = (&shared->databases[i] == MyDbState);
+			break;
+		}
+	}
+
+	maxcrossings = hash_get_num_entries(quota_totals_map);
+	crossings = palloc(Max(maxcrossings, 1) * sizeof(ThresholdCrossing));
+
+	hash_seq_init(&iter, quota_totals_map);
+	while ((qentry = hash_seq_search(&iter)) != NULL)
+	{
+		double		pct;
+		int			reached = 0;
+		ListCell   *lc;
+
+		if (qentry->key.dbid != MyDatabaseId &&
+			!(qentry->key.dbid == InvalidOid && cluster_notifier))
+			continue;
+
+		if (qentry->quota <= 0 || thresholds == NIL)
+		{
+			/* No quota, nothing to notify about. Forget any old crossing. */
+			qentry->notified_threshold = 0;
+			continue;
+		}
+
+		pct = (double) qentry->totalsize * 100.0 / qentry->quota;
+		foreach(lc, thresholds)
+		{
+			int			threshold = lfirst_int(lc);
+
+			/*
+			 * The threshold that was crossed last time is kept, until usage
+			 * falls clearly below it.
+			 */
+			if (pct >= threshold ||
+				(threshold == qentry->notified_threshold &&
+				 pct >= threshold - NOTIFY_HYSTERESIS))
+				reached = threshold;
+		}
+
+		if (reached != qentry->notified_threshold)
+		{
+			ThresholdCrossing *crossing = &crossings[ncrossings++];
+
+			crossing->kind = (qentry->key.dbid == InvalidOid) ?
+				QUOTA_CLUSTER : qentry->key.kind;
+			crossing->objid = qentry->key.objid;
+			crossing->up = (reached > qentry->notified_threshold);
+			crossing->threshold = crossing->up ? reached : qentry->notified_threshold;
+			crossing->totalsize = qentry->totalsize;
+			crossing->quota = qentry->quota;
+
+			qentry->notified_threshold = reached;
+		}
+	}
+
+	LWLockRelease(shared->lock);
+
+	for (i = 0; i < ncrossings; i++)
+	{
+		ThresholdCrossing *crossing = &crossings[i];
+		char	   *name = quota_object_name(crossing->kind, crossing->objid);
+		StringInfoData payload;
+
+		ereport(LOG,
+				(errmsg("disk space usage of %s \"%s\" %s %d%% of its quota",
+						quota_kind_name(crossing->kind), name,
+						crossing->up ? "reached" : "fell below",
+						crossing->threshold),
+				 errdetail("Using " INT64_FORMAT " bytes of " INT64_FORMAT " bytes.",
+						   crossing->totalsize, crossing->quota)));
+
+		if (RecoveryInProgress())
+			continue;
+
+		initStringInfo(&payload);
+		appendStringInfo(&payload, "{\"kind\": \"%s\", \"name\": ",
+						 quota_kind_name(crossing->kind));
+		escape_json(&payload, name);
+		appendStringInfo(&payload,
+						 ", \"oid\": %u, \"threshold\": %d, \"direction\": \"%s\", "
+						 "\"space_used\": " INT64_FORMAT ", \"quota\": " INT64_FORMAT "}",
+						 crossing->objid, crossing->threshold,
+						 crossing->up ? "up" : "down",
+						 crossing->totalsize, crossing->quota);
+		Async_Notify("pg_quota", payload.data);
+		pfree(payload.data);
+	}
+
+	pfree(crossings);
+}
+
+/*
+ * Returns the amount of memory allocated in a memory context and its
+ * children.
+ */
+static int64
+MemoryContextTotalSpace(MemoryContext context)
+{
+	MemoryContextCounters totals;
+	MemoryContext child;
+	int64		result;
+
+	memset(&totals, 0, sizeof(totals));
+	context->methods->stats(context, NULL, NULL, &totals);
+	result = totals.totalspace;
+
+	for (child = context->firstchild; child != NULL; child = child->nextchild)
+		result += MemoryContextTotalSpace(child);
+
+	return result;
+}
+
+/*
+ * Publish the statistics of the cycle that just finished, for the
+ * quota.scan_stats view.
+ */
+void
+PublishScanStats(void)
+{
+	instr_time	duration;
+	dlist_iter	iter;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, cycle_start);
+	curstats.cycle_time = INSTR_TIME_GET_MILLISEC(duration);
+
+	curstats.cycles++;
+	curstats.last_cycle_end = GetCurrentTimestamp();
+	curstats.files = hash_get_num_entries(path_to_fsentry_map);
+	curstats.relations = hash_get_num_entries(relfilenode_to_relentry_map);
+	curstats.orphans = 0;
+	dlist_foreach(iter, &orphanRels)
+		curstats.orphans++;
+	curstats.model_bytes = MemoryContextTotalSpace(FsModelContext);
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	MyDbState->scanstats = curstats;
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Publish the progress of the current cycle, for the quota.scan_progress
+ * view.
+ */
+static void
+ReportProgress(void)
+{
+	pg_quota_scan_progress *progress = &MyDbState->progress;
+
+	curprogress.dirs_done = curstats.dirs_scanned;
+
+	SpinLockAcquire(&progress->mutex);
+	progress->phase = curprogress.phase;
+	progress->phase_start = curprogress.phase_start;
+	progress->dirs_done = curprogress.dirs_done;
+	progress->dirs_total = curprogress.dirs_total;
+	progress->files_done = curprogress.files_done;
+	progress->files_total = curprogress.files_total;
+	progress->bytes_done = curprogress.bytes_done;
+	progress->orphans_remaining = curprogress.orphans_remaining;
+	SpinLockRelease(&progress->mutex);
+}
+
+/*
+ * Move to a new phase of the cycle, and publish the progress so far.
+ */
+void
+SetScanPhase(ScanPhase phase)
+{
+	curprogress.phase = phase;
+	curprogress.phase_start = GetCurrentTimestamp();
+	ReportProgress();
+}
+
+
+static int
+relsize_cmp(const void *a, const void *b)
+{
+	Oid			relid_a = ((const RelationSizeEntry *) a)->relid;
+	Oid			relid_b = ((const RelationSizeEntry *) b)->relid;
+
+	if (relid_a < relid_b)
+		return -1;
+	if (relid_a > relid_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Publish the current size of each relation in shared memory.
+ *
+ * The sizes of a table's files, its indexes and its TOAST table are rolled
+ * up to the table. The result is built as a new array in the DSA area, and
+ * swapped in place of the old one, so that readers only need to hold the
+ * lock while they copy it.
+ */
+void
+PublishRelationSizes(void)
+{
+	HASHCTL		hash_ctl;
+	HTAB	   *relid_to_relsize_map;
+	HASH_SEQ_STATUS iter;
+	RelSizeEntry *relentry;
+	RelationSizeEntry *relsize;
+	RelationSizeEntry *relsizes;
+	dsa_area   *area;
+	dsa_pointer newp;
+	dsa_pointer oldp;
+	long		nrelsizes;
+	int			i;
+
+	area = get_quota_area(true);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RelationSizeEntry);
+	hash_ctl.hcxt = FsModelContext;
+
+	relid_to_relsize_map = hash_create("relid to RelationSizeEntry map",
+									   1024,
+									   &hash_ctl,
+									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	hash_seq_init(&iter, relfilenode_to_relentry_map);
+	while ((relentry = hash_seq_search(&iter)) != NULL)
+	{
+		bool		found;
+
+		/* Not resolved from the catalogs yet */
+		if (!OidIsValid(relentry->toprelid))
+			continue;
+
+		relsize = (RelationSizeEntry *) hash_search(relid_to_relsize_map,
+													(void *) &relentry->toprelid,
+													HASH_ENTER, &found);
+		if (!found)
+		{
+			relsize->table_size = 0;
+			relsize->indexes_size = 0;
+			relsize->toast_size = 0;
+			relsize->reclaimable = 0;
+			relsize->free_space = 0;
+		}
+		relsize->reclaimable += relentry->free_bytes + relentry->dead_bytes;
+		if (relentry->kind == RELSIZE_TABLE)
+			relsize->free_space += relentry->free_bytes;
+
+		switch (relentry->kind)
+		{
+			case RELSIZE_TABLE:
+				relsize->table_size += relentry->totalsize;
+				break;
+			case RELSIZE_INDEX:
+				relsize->indexes_size += relentry->totalsize;
+				break;
+			case RELSIZE_TOAST:
+				relsize->toast_size += relentry->totalsize;
+				break;
+		}
+	}
+
+	nrelsizes = hash_get_num_entries(relid_to_relsize_map);
+	if (nrelsizes > 0)
+	{
+		newp = dsa_allocate_extended(area,
+									 nrelsizes * sizeof(RelationSizeEntry),
+									 DSA_ALLOC_HUGE);
+		relsizes = (RelationSizeEntry *) dsa_get_address(area, newp);
+
+		i = 0;
+		hash_seq_init(&iter, relid_to_relsize_map);
+		while ((relsize = hash_seq_search(&iter)) != NULL)
+			relsizes[i++] = *relsize;
+		qsort(relsizes, nrelsizes, sizeof(RelationSizeEntry), relsize_cmp);
+	}
+	else
+		newp = InvalidDsaPointer;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	oldp = MyDbState->relsizes;
+	MyDbState->relsizes = newp;
+	MyDbState->nrelsizes = nrelsizes;
+	LWLockRelease(shared->lock);
+
+	/* Nobody can be looking at the old array anymore. */
+	if (DsaPointerIsValid(oldp))
+		dsa_free(area, oldp);
+
+	hash_destroy(relid_to_relsize_map);
+}
+
+/* ---------------------------------------------------------------------------
+ * Functions for use in backend processes.
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * Has the quota of an object been exceeded? Caller must hold shared->lock.
+ */
+static bool
+QuotaExceeded(QuotaKind kind, Oid objid)
+{
+	QuotaEntry *qentry = FindQuotaEntry(kind, objid);
+
+	return (qentry &&
+			qentry->quota >= 0 &&
+			qentry->totalsize > qentry->quota);
+}
+
+/*
+ * Free space recorded in the FSM of a table, as of the sizes last published
+ * by the worker, or 0 if it's not known. Caller must hold shared->lock.
+ */
+static int64
+RelationFreeSpace(dsa_area *area, Oid relid)
+{
+	pg_quota_db_state *dbstate = get_db_state(MyDatabaseId);
+	RelationSizeEntry key;
+	RelationSizeEntry *relsize;
+
+	if (area == NULL || dbstate == NULL || dbstate->nrelsizes == 0)
+		return 0;
+
+	key.relid = relid;
+	relsize = (RelationSizeEntry *) bsearch(&key,
+											dsa_get_address(area, dbstate->relsizes),
+											dbstate->nrelsizes,
+											sizeof(RelationSizeEntry),
+											relsize_cmp);
+	return relsize ? relsize->free_space : 0;
+}
+
+/*
+ * Check all the quotas that apply to a relation with the given owner, schema
+ * and tablespace, in the current database.
+ *
+ * Returns 'true', if none of them has been exceeded yet. Otherwise returns
+ * 'false', and sets *violated to the kind of the quota that was exceeded.
+ *
+ * If 'headroom_relid' is valid, the free space recorded in the FSM of that
+ * table is not counted against the role's own quota, as new rows inserted
+ * into it can go there without growing it. Free space in the role's other
+ * tables doesn't help, a row can only use the free space of its own table.
+ */
+bool
+CheckQuota(Oid owner, Oid nspid, Oid spcid, Oid headroom_relid,
+		   QuotaKind *violated)
+{
+	QuotaEntry *qentry;
+	dsa_area   *area = NULL;
+	int64		headroom = 0;
+	bool		result = true;
+
+	if (!quota_totals_map)
+		return true;
+
+	/* Attach before taking the lock, get_quota_area() takes it too */
+	if (OidIsValid(headroom_relid))
+		area = get_quota_area(false);
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+
+	if (OidIsValid(headroom_relid))
+		headroom = RelationFreeSpace(area, headroom_relid);
+
+	qentry = FindQuotaEntry(QUOTA_ROLE, owner);
+	if (qentry && qentry->quota >= 0 &&
+		qentry->totalsize - headroom > qentry->quota)
+	{
+		/* User has a quota, and it's been exceeded. */
+		*violated = QUOTA_ROLE;
+		result = false;
+	}
+	else if (qentry && qentry->group_exceeded)
+	{
+		/* One of the user's groups has exceeded its quota. */
+		*violated = QUOTA_GROUP;
+		result = false;
+	}
+	else if ((qentry = FindQuotaEntryForDb(QUOTA_ROLE, owner, InvalidOid)) != NULL &&
+			 qentry->quota >= 0 && qentry->totalsize > qentry->quota)
+	{
+		/* User is over its cluster-wide quota. */
+		*violated = QUOTA_CLUSTER;
+		result = false;
+	}
+	else if (QuotaExceeded(QUOTA_NAMESPACE, nspid))
+	{
+		*violated = QUOTA_NAMESPACE;
+		result = false;
+	}
+	else if (QuotaExceeded(QUOTA_TABLESPACE, spcid))
+	{
+		*violated = QUOTA_TABLESPACE;
+		result = false;
+	}
+	else if (QuotaExceeded(QUOTA_DATABASE, MyDatabaseId))
+	{
+		*violated = QUOTA_DATABASE;
+		result = false;
+	}
+
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * Check the limits on the number of relations and files owned by a role.
+ *
+ * Returns 'true' if the role is below both limits. Otherwise returns
+ * 'false', and sets *files to tell which limit was reached.
+ */
+bool
+CheckCountQuota(Oid owner, bool *files)
+{
+	QuotaEntry *qentry;
+	bool		result = true;
+
+	if (!quota_totals_map)
+		return true;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+
+	qentry = FindQuotaEntry(QUOTA_ROLE, owner);
+	if (qentry && qentry->max_relations >= 0 &&
+		qentry->nrelations >= qentry->max_relations)
+	{
+		*files = false;
+		result = false;
+	}
+	else if (qentry && qentry->max_files >= 0 &&
+			 qentry->nfiles >= qentry->max_files)
+	{
+		*files = true;
+		result = false;
+	}
+
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * How long should a statement that writes to a relation owned by 'owner' be
+ * delayed, in milliseconds?
+ *
+ * There is no delay until the role's usage reaches 'threshold' percent of
+ * its quota. Past that, the delay ramps up linearly to 'max_delay' at the
+ * quota. It's further scaled down by how fast the role is growing: a role
+ * that would use up the rest of its quota within GROWTH_RATE_WINDOW
+ * seconds, at its current rate, gets the full delay, and a role that isn't
+ * growing at all gets none.
+ */
+long
+GetThrottleDelay(Oid owner, int threshold, int max_delay)
+{
+	QuotaEntry *qentry;
+	double		start;
+	double		ramp;
+	double		urgency;
+	double		remaining;
+	long		result = 0;
+
+	if (!quota_totals_map)
+		return 0;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+
+	qentry = FindQuotaEntry(QUOTA_ROLE, owner);
+	if (qentry && qentry->quota > 0 && qentry->growth_rate > 0)
+	{
+		start = qentry->quota * (threshold / 100.0);
+		if (qentry->totalsize >= start)
+		{
+			ramp = Min(1.0, (qentry->totalsize - start) / Max(qentry->quota - start, 1.0));
+
+			remaining = qentry->quota - qentry->totalsize;
+			if (remaining <= 0)
+				urgency = 1.0;
+			else
+				urgency = Min(1.0, qentry->growth_rate * GROWTH_RATE_WINDOW / remaining);
+
+			result = (long) (max_delay * ramp * urgency);
+		}
+	}
+
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * Copy of the fields of a QuotaEntry that the monitoring functions show.
+ */
+typedef struct QuotaEntrySnapshot
+{
+	QuotaEntryKey key;
+	int64		totalsize;
+	int64		quota;
+	int64		temp_used;
+	int64		temp_quota;
+	int64		nrelations;
+	int64		max_relations;
+	int64		nfiles;
+	int64		max_files;
+	int64		reclaimable;
+	int64		free_space;
+} QuotaEntrySnapshot;
+
+static void
+CopyQuotaEntry(QuotaEntrySnapshot *snap, QuotaEntry *qentry)
+{
+	snap->key = qentry->key;
+	snap->totalsize = qentry->totalsize;
+	snap->quota = qentry->quota;
+	snap->temp_used = qentry->temp_used;
+	snap->temp_quota = qentry->temp_quota;
+	snap->nrelations = qentry->nrelations;
+	snap->max_relations = qentry->max_relations;
+	snap->nfiles = qentry->nfiles;
+	snap->max_files = qentry->max_files;
+	snap->reclaimable = qentry->reclaimable;
+	snap->free_space = qentry->free_space;
+}
+
+/*
+ * Take a copy of the entries of one kind, for database 'dbid', or for all
+ * the databases if 'all_dbs' is true.
+ *
+ * The monitoring functions build their result from the copy, so that
+ * shared->lock is only held for as long as it takes to copy the entries,
+ * not while the tuplestore is filled, which could spill to disk. The entries
+ * of a database are found through its list of entries, so the other
+ * databases' entries are not visited. Cluster-wide entries don't belong to
+ * any database, so for those, the whole hash table is scanned.
+ */
+static QuotaEntrySnapshot *
+SnapshotQuotaEntries(QuotaKind kind, Oid dbid, bool all_dbs, int *nentries)
+{
+	QuotaEntrySnapshot *result;
+	int			n = 0;
+	int			maxentries;
+	int			i;
+
+	*nentries = 0;
+	if (!quota_totals_map)
+		return NULL;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+
+	/*
+	 * Allocating while holding an LWLock is OK; they're released on error.
+	 * The number of entries in the hash table is an upper bound.
+	 */
+	maxentries = hash_get_num_entries(quota_totals_map);
+	result = palloc(Max(maxentries, 1) * sizeof(QuotaEntrySnapshot));
+
+	if (!all_dbs && !OidIsValid(dbid))
+	{
+		HASH_SEQ_STATUS iter;
+		QuotaEntry *qentry;
+
+		hash_seq_init(&iter, quota_totals_map);
+		while ((qentry = hash_seq_search(&iter)) != NULL)
+		{
+			if (qentry->key.dbid == dbid && qentry->key.kind == kind)
+				CopyQuotaEntry(&result[n++], qentry);
+		}
+	}
+	else
+	{
+		for (i = 0; i < shared->num_databases; i++)
+		{
+			pg_quota_db_state *dbstate = &shared->databases[i];
+			dlist_iter	iter;
+
+			if (!OidIsValid(dbstate->dbid))
+				continue;
+			if (!all_dbs && dbstate->dbid != dbid)
+				continue;
+
+			dlist_foreach(iter, &dbstate->entries)
+			{
+				QuotaEntry *qentry = dlist_container(QuotaEntry, db_node, iter.cur);
+
+				if (qentry->key.kind == kind && qentry->key.dbid == dbstate->dbid)
+					CopyQuotaEntry(&result[n++], qentry);
+			}
+		}
+	}
+
+	LWLockRelease(shared->lock);
+
+	*nentries = n;
+	return result;
+}
+
+/*
+ * Append a Prometheus label value to 'buf', with the escapes that the text
+ * format requires.
+ */
+static void
+append_label_value(StringInfo buf, const char *value)
+{
+	const char *p;
+
+	appendStringInfoChar(buf, '"');
+	for (p = value; *p; p++)
+	{
+		switch (*p)
+		{
+			case '\\':
+				appendStringInfoString(buf, "\\\\");
+				break;
+			case '"':
+				appendStringInfoString(buf, "\\\"");
+				break;
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			default:
+				appendStringInfoChar(buf, *p);
+				break;
+		}
+	}
+	appendStringInfoChar(buf, '"');
+}
+
+/*
+ * Append the HELP and TYPE lines of a metric.
+ */
+static void
+append_metric_header(StringInfo buf, const char *name, const char *type,
+					 const char *help)
+{
+	appendStringInfo(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Append one sample of a per-role metric.
+ */
+static void
+append_role_sample(StringInfo buf, const char *name, const char *dbname,
+				   const char *rolname, int64 value)
+{
+	appendStringInfo(buf, "%s{database=", name);
+	append_label_value(buf, dbname);
+	appendStringInfoString(buf, ",role=");
+	append_label_value(buf, rolname);
+	appendStringInfo(buf, "} " INT64_FORMAT "\n", value);
+}
+
+/*
+ * Append one sample of a per-database metric.
+ */
+static void
+append_db_sample(StringInfo buf, const char *name, const char *dbname,
+				 const char *value)
+{
+	appendStringInfo(buf, "%s{database=", name);
+	append_label_value(buf, dbname);
+	appendStringInfo(buf, "} %s\n", value);
+}
+
+/*
+ * The per-role metrics in the metrics file. Limits are left out for the
+ * roles that don't have one.
+ */
+static const struct
+{
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t		offset;			/* of the value in QuotaEntrySnapshot */
+	bool		is_limit;
+}			role_metrics[] =
+{
+	{"pg_quota_space_used_bytes", "gauge",
+	 "Disk space used by the relations owned by the role.",
+	 offsetof(QuotaEntrySnapshot, totalsize), false},
+	{"pg_quota_quota_bytes", "gauge",
+	 "Disk space quota of the role.",
+	 offsetof(QuotaEntrySnapshot, quota), true},
+	{"pg_quota_temp_used_bytes", "gauge",
+	 "Space used by the role's temporary files.",
+	 offsetof(QuotaEntrySnapshot, temp_used), false},
+	{"pg_quota_temp_quota_bytes", "gauge",
+	 "Temporary file quota of the role.",
+	 offsetof(QuotaEntrySnapshot, temp_quota), true},
+	{"pg_quota_relations", "gauge",
+	 "Number of relations owned by the role.",
+	 offsetof(QuotaEntrySnapshot, nrelations), false},
+	{"pg_quota_max_relations", "gauge",
+	 "Limit on the number of relations owned by the role.",
+	 offsetof(QuotaEntrySnapshot, max_relations), true},
+	{"pg_quota_files", "gauge",
+	 "Number of segment files owned by the role.",
+	 offsetof(QuotaEntrySnapshot, nfiles), false},
+	{"pg_quota_max_files", "gauge",
+	 "Limit on the number of segment files owned by the role.",
+	 offsetof(QuotaEntrySnapshot, max_files), true},
+	{"pg_quota_reclaimable_bytes", "gauge",
+	 "Estimated space in the role's relations that VACUUM has freed or would free.",
+	 offsetof(QuotaEntrySnapshot, reclaimable), false},
+};
+
+/*
+ * Write the role totals and quotas, and the statistics of the last cycle,
+ * to <dir>/pg_quota_<database OID>.prom, in the Prometheus text format, for
+ * the node exporter's textfile collector.
+ *
+ * The file is written under a temporary name, which the collector ignores,
+ * and renamed into place, so that the collector never sees a partial file.
+ * Failures are logged, but don't stop the worker.
+ *
+ * Must be called in a transaction, to look up the role names, after
+ * PublishScanStats().
+ */
+void
+WriteMetricsFile(const char *dir)
+{
+	QuotaEntrySnapshot *entries;
+	int			nentries;
+	char	  **rolnames;
+	char	   *dbname;
+	int64		db_used = 0;
+	int64		db_quota = -1;
+	QuotaEntry *qentry;
+	StringInfoData buf;
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE	   *fp;
+	bool		ok;
+	int			i;
+	int			m;
+
+	dbname = get_database_name(MyDatabaseId);
+	if (dbname == NULL)
+		return;
+
+	entries = SnapshotQuotaEntries(QUOTA_ROLE, MyDatabaseId, false, &nentries);
+	rolnames = palloc(Max(nentries, 1) * sizeof(char *));
+	for (i = 0; i < nentries; i++)
+		rolnames[i] = GetUserNameFromId(entries[i].key.objid, true);
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	qentry = FindQuotaEntry(QUOTA_DATABASE, MyDatabaseId);
+	if (qentry)
+	{
+		db_used = qentry->totalsize;
+		db_quota = qentry->quota;
+	}
+	LWLockRelease(shared->lock);
+
+	initStringInfo(&buf);
+
+	for (m = 0; m < lengthof(role_metrics); m++)
+	{
+		append_metric_header(&buf, role_metrics[m].name, role_metrics[m].type,
+							 role_metrics[m].help);
+		for (i = 0; i < nentries; i++)
+		{
+			int64		value;
+
+			value = *(int64 *) ((char *) &entries[i] + role_metrics[m].offset);
+			if (rolnames[i] == NULL || (role_metrics[m].is_limit && value == -1))
+				continue;
+			append_role_sample(&buf, role_metrics[m].name, dbname, rolnames[i], value);
+		}
+	}
+
+	append_metric_header(&buf, "pg_quota_database_used_bytes", "gauge",
+						 "Disk space used by all the files of the database.");
+	append_db_sample(&buf, "pg_quota_database_used_bytes", dbname,
+					 psprintf(INT64_FORMAT, db_used));
+	if (db_quota != -1)
+	{
+		append_metric_header(&buf, "pg_quota_database_quota_bytes", "gauge",
+							 "Disk space quota of the database.");
+		append_db_sample(&buf, "pg_quota_database_quota_bytes", dbname,
+						 psprintf(INT64_FORMAT, db_quota));
+	}
+
+	append_metric_header(&buf, "pg_quota_scan_cycles_total", "counter",
+						 "Scan cycles completed by the worker.");
+	append_db_sample(&buf, "pg_quota_scan_cycles_total", dbname,
+					 psprintf(INT64_FORMAT, curstats.cycles));
+	append_metric_header(&buf, "pg_quota_scan_last_cycle_end_seconds", "gauge",
+						 "Time the last scan cycle ended, in seconds since the epoch.");
+	append_db_sample(&buf, "pg_quota_scan_last_cycle_end_seconds", dbname,
+					 psprintf("%.3f", timestamptz_to_time_t(curstats.last_cycle_end) +
+							  (curstats.last_cycle_end % USECS_PER_SEC) / 1000000.0));
+	append_metric_header(&buf, "pg_quota_scan_cycle_seconds", "gauge",
+						 "Duration of the last scan cycle.");
+	append_db_sample(&buf, "pg_quota_scan_cycle_seconds", dbname,
+					 psprintf("%.6f", curstats.cycle_time / 1000.0));
+	append_metric_header(&buf, "pg_quota_scan_dir_seconds", "gauge",
+						 "Time the last scan cycle spent walking the directories.");
+	append_db_sample(&buf, "pg_quota_scan_dir_seconds", dbname,
+					 psprintf("%.6f", curstats.scan_time / 1000.0));
+	append_metric_header(&buf, "pg_quota_scan_stat_calls", "gauge",
+						 "stat() calls made by the last scan cycle.");
+	append_db_sample(&buf, "pg_quota_scan_stat_calls", dbname,
+					 psprintf(INT64_FORMAT, curstats.stat_calls));
+	append_metric_header(&buf, "pg_quota_model_files", "gauge",
+						 "Files in the worker's model.");
+	append_db_sample(&buf, "pg_quota_model_files", dbname,
+					 psprintf(INT64_FORMAT, curstats.files));
+	append_metric_header(&buf, "pg_quota_model_relations", "gauge",
+						 "Relations in the worker's model.");
+	append_db_sample(&buf, "pg_quota_model_relations", dbname,
+					 psprintf(INT64_FORMAT, curstats.relations));
+	append_metric_header(&buf, "pg_quota_model_orphans", "gauge",
+						 "Relations in the worker's model with no known owner.");
+	append_db_sample(&buf, "pg_quota_model_orphans", dbname,
+					 psprintf(INT64_FORMAT, curstats.orphans));
+	append_metric_header(&buf, "pg_quota_model_memory_bytes", "gauge",
+						 "Memory used by the worker's model.");
+	append_db_sample(&buf, "pg_quota_model_memory_bytes", dbname,
+					 psprintf(INT64_FORMAT, curstats.model_bytes));
+
+	snprintf(path, MAXPGPATH, "%s/pg_quota_%u.prom", dir, MyDatabaseId);
+	snprintf(tmppath, MAXPGPATH, "%s/pg_quota_%u.prom.%d.tmp", dir,
+			 MyDatabaseId, MyProcPid);
+
+	fp = AllocateFile(tmppath, PG_BINARY_W);
+	if (fp == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open metrics file \"%s\": %m", tmppath)));
+		return;
+	}
+	ok = (fwrite(buf.data, 1, buf.len, fp) == buf.len);
+	if (FreeFile(fp) != 0)
+		ok = false;
+	if (!ok)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write metrics file \"%s\": %m", tmppath)));
+		unlink(tmppath);
+		return;
+	}
+
+	(void) durable_rename(tmppath, path, LOG);
+}
+
+/*
+ * Function to implement the quota.status view.
+ */
+Datum
+get_quota_status(PG_FUNCTION_ARGS)
+{
+#define GET_QUOTA_STATUS_COLS	11
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	QuotaEntrySnapshot *entries;
+	int			nentries;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	entries = SnapshotQuotaEntries(QUOTA_ROLE, MyDatabaseId, false, &nentries);
+	for (i = 0; i < nentries; i++)
+	{
+		QuotaEntrySnapshot *qentry = &entries[i];
+		/* for each row */
+		Datum		values[GET_QUOTA_STATUS_COLS];
+		bool		nulls[GET_QUOTA_STATUS_COLS];
+
+		values[0] = qentry->key.objid;
+		nulls[0] = false;
+		values[1] = qentry->totalsize;
+		nulls[1] = false;
+		if (qentry->quota != -1)
+		{
+			values[2] = qentry->quota;
+			nulls[2] = false;
+		}
+		else
+		{
+			values[2] = (Datum) 0;
+			nulls[2] = true;
+		}
+		values[3] = qentry->temp_used;
+		nulls[3] = false;
+		if (qentry->temp_quota != -1)
+		{
+			values[4] = qentry->temp_quota;
+			nulls[4] = false;
+		}
+		else
+		{
+			values[4] = (Datum) 0;
+			nulls[4] = true;
+		}
+		values[5] = Int64GetDatum(qentry->nrelations);
+		nulls[5] = false;
+		values[6] = Int64GetDatum(qentry->max_relations);
+		nulls[6] = (qentry->max_relations == -1);
+		values[7] = Int64GetDatum(qentry->nfiles);
+		nulls[7] = false;
+		values[8] = Int64GetDatum(qentry->max_files);
+		nulls[8] = (qentry->max_files == -1);
+		values[9] = Int64GetDatum(qentry->reclaimable);
+		nulls[9] = false;
+		values[10] = Int64GetDatum(qentry->free_space);
+		nulls[10] = false;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Function to implement the quota.cluster_status, quota.group_status,
+ * quota.schema_status, quota.tablespace_status and quota.database_status
+ * views.
+ */
+Datum
+get_quota_totals(PG_FUNCTION_ARGS)
+{
+#define GET_QUOTA_TOTALS_COLS	3
+	char	   *kindstr = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	QuotaEntrySnapshot *entries;
+	int			nentries;
+	int			i;
+	QuotaKind	kind;
+	Oid			dbid = MyDatabaseId;
+	bool		all_dbs = false;
+
+	if (strcmp(kindstr, "cluster") == 0)
+	{
+		/* cluster-wide role totals */
+		kind = QUOTA_ROLE;
+		dbid = InvalidOid;
+	}
+	else if (strcmp(kindstr, "group") == 0)
+		kind = QUOTA_GROUP;
+	else if (strcmp(kindstr, "schema") == 0)
+		kind = QUOTA_NAMESPACE;
+	else if (strcmp(kindstr, "tablespace") == 0)
+		kind = QUOTA_TABLESPACE;
+	else if (strcmp(kindstr, "database") == 0)
+	{
+		/* the totals of all databases are shown in every database */
+		kind = QUOTA_DATABASE;
+		all_dbs = true;
+	}
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized quota kind \"%s\"", kindstr)));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	entries = SnapshotQuotaEntries(kind, dbid, all_dbs, &nentries);
+	for (i = 0; i < nentries; i++)
+	{
+		QuotaEntrySnapshot *qentry = &entries[i];
+		Datum		values[GET_QUOTA_TOTALS_COLS];
+		bool		nulls[GET_QUOTA_TOTALS_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(qentry->key.objid);
+		values[1] = Int64GetDatum(qentry->totalsize);
+		if (qentry->quota != -1)
+			values[2] = Int64GetDatum(qentry->quota);
+		else
+		{
+			values[2] = (Datum) 0;
+			nulls[2] = true;
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Function to implement the quota.relation_sizes view.
+ */
+Datum
+get_relation_sizes(PG_FUNCTION_ARGS)
+{
+#define GET_RELATION_SIZES_COLS	6
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	dsa_area   *area;
+	pg_quota_db_state *dbstate;
+	RelationSizeEntry *relsizes = NULL;
+	int			nrelsizes = 0;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	area = get_quota_area(false);
+	if (area)
+	{
+		/*
+		 * Copy the array, so that we don't need to hold the lock while we
+		 * build the result.
+		 */
+		LWLockAcquire(shared->lock, LW_SHARED);
+
+		dbstate = get_db_state(MyDatabaseId);
+		if (dbstate && dbstate->nrelsizes > 0)
+		{
+			nrelsizes = dbstate->nrelsizes;
+			relsizes = palloc_extended(nrelsizes * sizeof(RelationSizeEntry),
+									   MCXT_ALLOC_HUGE);
+			memcpy(relsizes, dsa_get_address(area, dbstate->relsizes),
+				   nrelsizes * sizeof(RelationSizeEntry));
+		}
+
+		LWLockRelease(shared->lock);
+	}
+
+	for (i = 0; i < nrelsizes; i++)
+	{
+		Datum		values[GET_RELATION_SIZES_COLS];
+		bool		nulls[GET_RELATION_SIZES_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(relsizes[i].relid);
+		values[1] = Int64GetDatum(relsizes[i].table_size);
+		values[2] = Int64GetDatum(relsizes[i].indexes_size);
+		values[3] = Int64GetDatum(relsizes[i].toast_size);
+		values[4] = Int64GetDatum(relsizes[i].table_size +
+								  relsizes[i].indexes_size +
+								  relsizes[i].toast_size);
+		values[5] = Int64GetDatum(relsizes[i].reclaimable);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Function to implement the quota.scan_stats view.
+ */
+Datum
+get_scan_stats(PG_FUNCTION_ARGS)
+{
+#define GET_SCAN_STATS_COLS	14
+	TupleDesc	tupdesc;
+	Datum		values[GET_SCAN_STATS_COLS];
+	bool		nulls[GET_SCAN_STATS_COLS];
+	pg_quota_db_state *dbstate;
+	pg_quota_scan_stats stats;
+	bool		found = false;
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (shared)
+	{
+		LWLockAcquire(shared->lock, LW_SHARED);
+		dbstate = get_db_state(MyDatabaseId);
+		if (dbstate && dbstate->scanstats.cycles > 0)
+		{
+			stats = dbstate->scanstats;
+			found = true;
+		}
+		LWLockRelease(shared->lock);
+	}
+
+	/* No worker for this database, or it hasn't finished a cycle yet */
+	if (!found)
+		PG_RETURN_NULL();
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(stats.pid);
+	values[1] = Int64GetDatum(stats.cycles);
+	values[2] = TimestampTzGetDatum(stats.last_cycle_end);
+	values[3] = Float8GetDatum(stats.cycle_time);
+	values[4] = Float8GetDatum(stats.scan_time);
+	values[5] = Float8GetDatum(stats.sweep_time);
+	values[6] = Float8GetDatum(stats.orphans_time);
+	values[7] = Int64GetDatum(stats.dirs_scanned);
+	values[8] = Int64GetDatum(stats.stat_calls);
+	values[9] = Int64GetDatum(stats.files);
+	values[10] = Int64GetDatum(stats.relations);
+	values[11] = Int64GetDatum(stats.orphans);
+	values[12] = Int64GetDatum(stats.model_bytes);
+	values[13] = Int64GetDatum(stats.skipped_scans);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
 
 /*
- * Scan file system, to update the model with all files.
+ * Function to implement the quota.scan_progress view.
  */
-void
-refresh_fs_model(void)
+Datum
+get_scan_progress(PG_FUNCTION_ARGS)
 {
-	DIR		   *dirdesc;
-	struct dirent *dirent;
-	char		path[MAXPGPATH];
-	HASH_SEQ_STATUS iter;
-	FileSizeEntry *fsentry;
-
-	/*
-	 * Bump the generation counter first, so that we can detect removed files.
-	 */
-	generation++;
+#define GET_SCAN_PROGRESS_COLS	9
+	static const char *const phase_names[] = {
+		"idle",
+		"bootstrapping",
+		"scanning directories",
+		"removing deleted files",
+		"resolving owners",
+		"estimating reclaimable space",
+		"publishing relation sizes",
+		"loading quotas",
+		"verifying"
+	};
+	TupleDesc	tupdesc;
+	Datum		values[GET_SCAN_PROGRESS_COLS];
+	bool		nulls[GET_SCAN_PROGRESS_COLS];
+	pg_quota_db_state *dbstate;
+	pg_quota_scan_progress progress;
+	int			pid = 0;
 
-	/* global/<relid> */
-	/* ignore shared relations */
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	/* base/<dbid>/<relid> */
-	dirdesc = AllocateDir("base");
-	while ((dirent = ReadDirExtended(dirdesc, "base", DEBUG1)) != NULL)
+	if (shared)
 	{
-		Oid			dbid;
+		LWLockAcquire(shared->lock, LW_SHARED);
+		dbstate = get_db_state(MyDatabaseId);
+		if (dbstate && dbstate->scanstats.pid != 0)
+		{
+			pid = dbstate->scanstats.pid;
+			SpinLockAcquire(&dbstate->progress.mutex);
+			progress = dbstate->progress;
+			SpinLockRelease(&dbstate->progress.mutex);
+		}
+		LWLockRelease(shared->lock);
+	}
 
-		if (strcmp(dirent->d_name, ".") == 0 ||
-			strcmp(dirent->d_name, "..") == 0)
-			continue;
+	/* No worker for this database */
+	if (pid == 0)
+		PG_RETURN_NULL();
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(pid);
+	values[1] = CStringGetTextDatum(phase_names[progress.phase]);
+	values[2] = TimestampTzGetDatum(progress.phase_start);
+	values[3] = Int64GetDatum(progress.dirs_done);
+	values[4] = Int64GetDatum(progress.dirs_total);
+	values[5] = Int64GetDatum(progress.files_done);
+	/* Unknown until the first cycle has finished */
+	if (progress.files_total > 0)
+		values[6] = Int64GetDatum(progress.files_total);
+	else
+		nulls[6] = true;
+	values[7] = Int64GetDatum(progress.bytes_done);
+	values[8] = Int64GetDatum(progress.orphans_remaining);
 
-		if (sscanf(dirent->d_name, "%u", &dbid) != 1)
-			continue;
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
 
-		snprintf(path, MAXPGPATH, "base/%s", dirent->d_name);
-		RebuildRelSizeMapDir(path);
-	}
-	FreeDir(dirdesc);
+/*
+ * Copy the usage history of a role entry to 'samples', oldest first.
+ * Returns the number of samples. Caller must hold shared->lock.
+ */
+static int
+CopyUsageHistory(dsa_area *area, QuotaEntry *qentry, UsageSample *samples)
+{
+	UsageHistory *history;
+	int			first;
+	int			i;
 
-	/*
-	 * pg_tblspc/<tblspc oid>/<tblspc version>/
-	 *		within a non-default tablespace (the name of the directory
-	 *		depends on version)
-	 */
-	/* TODO */
+	if (area == NULL || !DsaPointerIsValid(qentry->history))
+		return 0;
 
-	/*
-	 * Finally, remove files that no longer exist.
-	 */
-	hash_seq_init(&iter, path_to_fsentry_map);
+	history = dsa_get_address(area, qentry->history);
+	first = (history->next - history->count + USAGE_HISTORY_SIZE) % USAGE_HISTORY_SIZE;
+	for (i = 0; i < history->count; i++)
+		samples[i] = history->samples[(first + i) % USAGE_HISTORY_SIZE];
 
-	while ((fsentry = hash_seq_search(&iter)) != NULL)
-	{
-		if (fsentry->generation != generation)
-		{
-			/*
-			 * We didn't see this file during this scan, so it doesn't
-			 * exist anymore.
-			 */
-			RemoveFileSize(fsentry);
-		}
-	}
+	return history->count;
 }
 
 /*
- * Update the owner of a relation in the model.
+ * Function to implement quota.usage_history(role).
  */
-void
-UpdateRelOwner(RelFileNode *rnode, Oid owner)
+Datum
+get_usage_history(PG_FUNCTION_ARGS)
 {
-	RelSizeEntry *relentry;
-	RoleSizeEntry *rolentry;
-	RoleSizeEntryKey key;
-	bool		found;
+#define GET_USAGE_HISTORY_COLS	2
+	Oid			rolid = PG_GETARG_OID(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	QuotaEntry *qentry;
+	UsageSample samples[USAGE_HISTORY_SIZE];
+	int			nsamples = 0;
+	int			i;
 
-	relentry = (RelSizeEntry *) hash_search(relfilenode_to_relentry_map,
-											(void *) rnode,
-											HASH_FIND, &found);
-	if (!found)
-		return;
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
 
-	if (relentry->owner == owner)
-		return;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	/* Subtract the old size from the old owner's total. */
-	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	key.rolid = relentry->owner;
-	key.dbid = MyDatabaseId;
-	rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-											 (void *) &key,
-											 HASH_FIND, &found);
-	Assert(found == (relentry->owner != InvalidOid));
-	if (found)
-		rolentry->totalsize -= relentry->totalsize;
-	LWLockRelease(shared->lock);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-	relentry->owner = owner;
-	if (relentry->owner == InvalidOid)
-		dlist_delete(&relentry->orphan_node);
+	MemoryContextSwitchTo(oldcontext);
 
-	if (owner != InvalidOid)
+	if (quota_totals_map)
 	{
-		/* Link to new parent, creating it if it doesn't exist yet. */
-		key.rolid = owner;
-		key.dbid = MyDatabaseId;
+		dsa_area   *area = get_quota_area(false);
 
-		LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+		LWLockAcquire(shared->lock, LW_SHARED);
+		qentry = FindQuotaEntry(QUOTA_ROLE, rolid);
+		if (qentry)
+			nsamples = CopyUsageHistory(area, qentry, samples);
+		LWLockRelease(shared->lock);
+	}
 
-		rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-												 (void *) &key,
-												 HASH_ENTER, &found);
-		if (!found)
-		{
-			rolentry->totalsize = 0;
-			rolentry->quota = -1;	/* -1 means no quota */
-		}
-		rolentry->totalsize += relentry->totalsize;
+	for (i = 0; i < nsamples; i++)
+	{
+		Datum		values[GET_USAGE_HISTORY_COLS];
+		bool		nulls[GET_USAGE_HISTORY_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = TimestampTzGetDatum(samples[i].time);
+		values[1] = Int64GetDatum(samples[i].size);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
-	else
-		dlist_push_head(&orphanRels, &relentry->orphan_node);
 
-	LWLockRelease(shared->lock);
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
 /*
- * Update the quota for a role.
- *
- * This update the quota field in the in-memory model. This is used when the
- * quotas are loaded from the cofiguration table.
+ * Fit a line to the usage samples, by least squares, and return its slope
+ * in bytes per second. There must be at least two samples.
  */
-void
-UpdateQuota(Oid owner, int64 newquota)
+static double
+UsageSlope(UsageSample *samples, int nsamples)
 {
-	RoleSizeEntry *rolentry;
-	RoleSizeEntryKey key;
-	bool		found;
-
-	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
-
-	key.rolid = owner;
-	key.dbid = MyDatabaseId;
-	rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-											 (void *) &key,
-											 HASH_ENTER, &found);
-	if (!found)
-		rolentry->totalsize = 0;
+	double		sum_x = 0;
+	double		sum_y = 0;
+	double		sum_xx = 0;
+	double		sum_xy = 0;
+	double		denom;
+	int			i;
+
+	for (i = 0; i < nsamples; i++)
+	{
+		/* seconds since the first sample */
+		double		x = (samples[i].time - samples[0].time) / 1000000.0;
+		/* and bytes relative to it, to keep the sums small */
+		double		y = samples[i].size - samples[0].size;
+
+		sum_x += x;
+		sum_y += y;
+		sum_xx += x * x;
+		sum_xy += x * y;
+	}
 
-	rolentry->quota = newquota;
+	denom = nsamples * sum_xx - sum_x * sum_x;
+	if (denom <= 0)
+		return 0;
 
-	LWLockRelease(shared->lock);
+	return (nsamples * sum_xy - sum_x * sum_y) / denom;
 }
 
 /*
- * Scan the list of relations that without owner information, and get their
- * owners.
+ * Function to implement the quota.forecast view.
+ *
+ * For each role in this database, returns the current usage and quota, the
+ * growth in bytes per hour over the samples in the history ring, and the
+ * estimated time until the quota is reached at that rate. The time is NULL
+ * if the role has no quota, or isn't growing, and zero if it's already over.
  */
-void
-UpdateOrphans(void)
+Datum
+get_usage_forecast(PG_FUNCTION_ARGS)
 {
-	dlist_mutable_iter iter;
+#define GET_USAGE_FORECAST_COLS	5
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pg_quota_db_state *dbstate;
+	dlist_iter	iter;
+	typedef struct
+	{
+		Oid			rolid;
+		int64		totalsize;
+		int64		quota;
+		int			nsamples;
+		UsageSample samples[USAGE_HISTORY_SIZE];
+	} RoleHistory;
+	RoleHistory *roles = NULL;
+	int			nroles = 0;
+	int			maxroles;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	dlist_foreach_modify(iter, &orphanRels)
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * Copy the histories out while holding the lock, and do the math after
+	 * releasing it.
+	 */
+	if (quota_totals_map)
 	{
-		RelSizeEntry *relentry = (RelSizeEntry *)
-			dlist_container(RelSizeEntry, orphan_node, iter.cur);
-		Oid			owner;
+		dsa_area   *area = get_quota_area(false);
 
-		owner = get_relfilenode_owner(&relentry->rnode);
-		if (owner)
+		LWLockAcquire(shared->lock, LW_SHARED);
+
+		maxroles = hash_get_num_entries(quota_totals_map);
+		roles = palloc(Max(maxroles, 1) * sizeof(RoleHistory));
+
+		dbstate = get_db_state(MyDatabaseId);
+		if (dbstate)
 		{
-			UpdateRelOwner(&relentry->rnode, owner);
+			dlist_foreach(iter, &dbstate->entries)
+			{
+				QuotaEntry *qentry = dlist_container(QuotaEntry, db_node, iter.cur);
+				RoleHistory *role;
 
-			/* Note: UpdateRelOwner() unlinks the entry from this list */
+				if (qentry->key.kind != QUOTA_ROLE)
+					continue;
 
-			elog(DEBUG1, "updated owner of relation %u/%u/%u to %u",
-				 relentry->rnode.dbNode, relentry->rnode.spcNode, relentry->rnode.relNode, owner);
+				role = &roles[nroles++];
+				role->rolid = qentry->key.objid;
+				role->totalsize = qentry->totalsize;
+				role->quota = qentry->quota;
+				role->nsamples = CopyUsageHistory(area, qentry, role->samples);
+			}
 		}
+
+		LWLockRelease(shared->lock);
 	}
-}
 
+	for (i = 0; i < nroles; i++)
+	{
+		RoleHistory *role = &roles[i];
+		Datum		values[GET_USAGE_FORECAST_COLS];
+		bool		nulls[GET_USAGE_FORECAST_COLS];
+		double		slope = 0;
+		double		seconds = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(role->rolid);
+		values[1] = Int64GetDatum(role->totalsize);
+		if (role->quota != -1)
+			values[2] = Int64GetDatum(role->quota);
+		else
+			nulls[2] = true;
 
-/* ---------------------------------------------------------------------------
- * Functions for use in backend processes.
- * ---------------------------------------------------------------------------
- */
+		if (role->nsamples >= 2)
+		{
+			slope = UsageSlope(role->samples, role->nsamples);
+			values[3] = Float8GetDatum(slope * SECS_PER_HOUR);
+		}
+		else
+			nulls[3] = true;
 
-/*
- * Returns 'true', if the quota for 'owner' has not been exceeded yet.
- */
-bool
-CheckQuota(Oid owner)
-{
-	RoleSizeEntry *rolentry;
-	RoleSizeEntryKey key;
-	bool		result;
+		if (role->quota != -1 && role->totalsize >= role->quota)
+		{
+			Interval   *interval = palloc0(sizeof(Interval));
 
-	if (!role_totals_map)
-		return true;
+			values[4] = IntervalPGetDatum(interval);
+		}
+		else if (role->quota != -1 && slope > 0 &&
+				 (seconds = (role->quota - role->totalsize) / slope) <= FORECAST_HORIZON)
+		{
+			Interval   *interval = palloc0(sizeof(Interval));
 
-	LWLockAcquire(shared->lock, LW_SHARED);
+			interval->time = (TimeOffset) (seconds * USECS_PER_SEC);
+			values[4] = DirectFunctionCall1(interval_justify_hours,
+											IntervalPGetDatum(interval));
+		}
+		else
+			nulls[4] = true;
 
-	key.rolid = owner;
-	key.dbid = MyDatabaseId;
-	rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-											 (void *) &key,
-											 HASH_FIND, NULL);
-	if (rolentry &&
-		rolentry->quota >= 0 &&
-		rolentry->totalsize > rolentry->quota)
-	{
-		/* User has a quota, and it's been exceeded. */
-		result = false;
-	}
-	else
-	{
-		result = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
 
-	LWLockRelease(shared->lock);
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
 
-	return result;
+	return (Datum) 0;
 }
 
 /*
- * Function to implement the quota.status view.
+ * Function to implement quota.verify(sample_fraction, repair).
+ *
+ * The model lives in the worker's local memory, so the audit is done by the
+ * worker, see VerifyModel(). We post the request, and wait for the worker to
+ * complete it. If several backends ask at the same time, they may all get
+ * the results of one audit.
  */
 Datum
-get_quota_status(PG_FUNCTION_ARGS)
+verify_model(PG_FUNCTION_ARGS)
 {
-#define GET_QUOTA_STATUS_COLS	3
+#define VERIFY_MODEL_COLS	8
+	double		fraction = PG_GETARG_FLOAT8(0);
+	bool		repair = PG_GETARG_BOOL(1);
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
 	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
-	HASH_SEQ_STATUS iter;
-	RoleSizeEntry *rolentry;
+	pg_quota_db_state *dbstate;
+	Latch	   *latch;
+	uint64		request;
+	dsa_area   *area;
+	VerifyResult *results = NULL;
+	int			nresults = 0;
+	int			i;
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -772,6 +4567,15 @@ get_quota_status(PG_FUNCTION_ARGS)
 				 errmsg("materialize mode required, but it is not " \
 						"allowed in this context")));
 
+	if (fraction <= 0 || fraction > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample fraction must be between 0 and 1")));
+	if (repair && !superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to repair the disk quota model")));
+
 	/* Build a tuple descriptor for our result type */
 	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "return type must be a row type");
@@ -786,40 +4590,105 @@ get_quota_status(PG_FUNCTION_ARGS)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	if (role_totals_map)
-	{
-		LWLockAcquire(shared->lock, LW_SHARED);
+	if (!shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_quota must be loaded via shared_preload_libraries")));
 
-		hash_seq_init(&iter, role_totals_map);
-		while ((rolentry = hash_seq_search(&iter)) != NULL)
+	/* Post the request, or join the pending one */
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	dbstate = get_db_state(MyDatabaseId);
+	if (dbstate == NULL || dbstate->worker_latch == NULL)
+	{
+		LWLockRelease(shared->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no disk quota worker is running for this database")));
+	}
+	if (dbstate->verify_requested != dbstate->verify_completed)
+	{
+		if (dbstate->verify_fraction != fraction ||
+			dbstate->verify_repair != repair)
 		{
-			/* for each row */
-			Datum		values[GET_QUOTA_STATUS_COLS];
-			bool		nulls[GET_QUOTA_STATUS_COLS];
+			double		pending_fraction = dbstate->verify_fraction;
+			bool		pending_repair = dbstate->verify_repair;
 
-			/* Ignore entries for other databases. */
-			if (rolentry->key.dbid != MyDatabaseId)
-				continue;
+			LWLockRelease(shared->lock);
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_IN_USE),
+					 errmsg("another verification of the disk quota model is in progress"),
+					 errdetail("It samples %g of the model, %s repair.",
+							   pending_fraction,
+							   pending_repair ? "with" : "without"),
+					 errhint("Try again after it has completed, or call quota.verify() with the same arguments to wait for its results.")));
+		}
+		request = dbstate->verify_requested;
+	}
+	else
+	{
+		dbstate->verify_fraction = fraction;
+		dbstate->verify_repair = repair;
+		request = ++dbstate->verify_requested;
+	}
+	latch = dbstate->worker_latch;
+	LWLockRelease(shared->lock);
 
-			values[0] = rolentry->key.rolid;
-			nulls[0] = false;
-			values[1] = rolentry->totalsize;
-			nulls[1] = false;
-			if (rolentry->quota != -1)
-			{
-				values[2] = rolentry->quota;
-				nulls[2] = false;
-			}
-			else
-			{
-				values[2] = (Datum) 0;
-				nulls[2] = true;
-			}
+	SetLatch(latch);
 
-			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-		}
+	/* Wait for the worker to complete it, and copy the results */
+	ConditionVariablePrepareToSleep(&dbstate->verify_cv);
+	for (;;)
+	{
+		bool		done;
+		bool		worker_gone;
 
+		LWLockAcquire(shared->lock, LW_SHARED);
+		done = (dbstate->verify_completed >= request);
+		worker_gone = (dbstate->worker_latch == NULL);
+		if (done && dbstate->nverify_results > 0)
+		{
+			area = get_quota_area(false);
+			nresults = dbstate->nverify_results;
+			results = palloc(nresults * sizeof(VerifyResult));
+			memcpy(results, dsa_get_address(area, dbstate->verify_results),
+				   nresults * sizeof(VerifyResult));
+		}
 		LWLockRelease(shared->lock);
+
+		if (done)
+			break;
+		if (worker_gone)
+		{
+			ConditionVariableCancelSleep();
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("disk quota worker exited before completing the verification")));
+		}
+
+		ConditionVariableSleep(&dbstate->verify_cv, PG_WAIT_EXTENSION);
+	}
+	ConditionVariableCancelSleep();
+
+	for (i = 0; i < nresults; i++)
+	{
+		VerifyResult *result = &results[i];
+		Datum		values[VERIFY_MODEL_COLS];
+		bool		nulls[VERIFY_MODEL_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+		if (OidIsValid(result->rolid))
+			values[0] = ObjectIdGetDatum(result->rolid);
+		else
+			nulls[0] = true;
+		values[1] = Int64GetDatum(result->sampled_files);
+		values[2] = Int64GetDatum(result->sampled_bytes);
+		values[3] = Int64GetDatum(result->missing_files);
+		values[4] = Int64GetDatum(result->size_mismatches);
+		values[5] = Int64GetDatum(result->owner_mismatches);
+		values[6] = Int64GetDatum(result->error_bytes);
+		values[7] = Int64GetDatum(result->estimated_error_bytes);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
 
 	/* clean up and return the tuplestore */
@@ -0,0 +1,364 @@
+/* -------------------------------------------------------------------------
+ *
+ * parallel_scan.c
+ *		Scan the data directory with helper background workers.
+ *
+ * When the database has relations in several tablespaces, on separate
+ * devices, walking the directories one after another takes the sum of the
+ * devices' metadata latencies. Instead, the worker can launch dynamic
+ * background workers to scan the directories concurrently. Each helper
+ * is assigned some of the directories, and streams the sizes of the files
+ * it finds back to the worker through a shm_mq. The worker applies them to
+ * its model as they arrive, so the model itself is still only touched by
+ * one process.
+ *
+ * If a helper can't be launched, or dies before it has finished, the
+ * directories it didn't finish are returned to the caller, to be scanned
+ * serially. That's important, because a file that's not seen in a scan is
+ * assumed to have been removed.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/transam.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "tcop/tcopprot.h"
+#include "utils/resowner.h"
+
+#include "pg_quota.h"
+
+void		pg_quota_scan_helper_main(Datum) pg_attribute_noreturn();
+
+#define PG_QUOTA_SCAN_MAGIC		0x51554f54
+#define PG_QUOTA_SCAN_QUEUE_SIZE	65536
+
+/* shm_toc keys. The queue of helper i has key PARALLEL_SCAN_KEY_QUEUE + i. */
+#define PARALLEL_SCAN_KEY_SHARED	0
+#define PARALLEL_SCAN_KEY_QUEUE		1
+
+/*
+ * A directory to scan, and the helper it's assigned to.
+ */
+typedef struct ParallelScanDir
+{
+	char		path[MAXPGPATH];
+	int			helper;
+	bool		done;			/* set by the helper when it's finished */
+	int64		stat_calls;		/* set by the helper, with 'done' */
+} ParallelScanDir;
+
+typedef struct ParallelScanShared
+{
+	int			ndirs;
+	ParallelScanDir dirs[FLEXIBLE_ARRAY_MEMBER];
+} ParallelScanShared;
+
+/*
+ * Message sent by a helper for each relation file.
+ */
+typedef struct ParallelScanFile
+{
+	RelFileNode rnode;
+	off_t		size;
+	char		path[FLEXIBLE_ARRAY_MEMBER];	/* null-terminated */
+} ParallelScanFile;
+
+/* In a helper, the queue to send the results to */
+static shm_mq_handle *helper_mqh;
+
+/*
+ * Scan 'dirs', a list of directory paths relative to the data directory,
+ * with up to 'nworkers' helper workers. 'callback' is called in this
+ * process for each relation file found.
+ *
+ * Returns the directories that were not scanned, because a helper could not
+ * be launched or died. The number of directories scanned and files stat()ed
+ * are added to *dirs_scanned and *stat_calls.
+ */
+List *
+ParallelScanDirs(List *dirs, int nworkers, ScanFileCallback callback,
+				 int64 *dirs_scanned, int64 *stat_calls)
+{
+	int			ndirs = list_length(dirs);
+	int			nhelpers = Min(nworkers, ndirs);
+	shm_toc_estimator e;
+	Size		shared_size;
+	Size		segsize;
+	dsm_segment *seg;
+	shm_toc    *toc;
+	ParallelScanShared *pscan;
+	shm_mq_handle **mqh;
+	int			nactive;
+	BackgroundWorker worker;
+	ListCell   *lc;
+	List	   *unfinished = NIL;
+	int			i;
+
+	if (nhelpers < 1 || ndirs < 2)
+		return dirs;
+
+	shared_size = add_size(offsetof(ParallelScanShared, dirs),
+						   mul_size(ndirs, sizeof(ParallelScanDir)));
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, shared_size);
+	for (i = 0; i < nhelpers; i++)
+		shm_toc_estimate_chunk(&e, PG_QUOTA_SCAN_QUEUE_SIZE);
+	shm_toc_estimate_keys(&e, 1 + nhelpers);
+	segsize = shm_toc_estimate(&e);
+
+	seg = dsm_create(segsize, 0);
+	toc = shm_toc_create(PG_QUOTA_SCAN_MAGIC, dsm_segment_address(seg), segsize);
+
+	/* Assign the directories to the helpers, round-robin */
+	pscan = shm_toc_allocate(toc, shared_size);
+	pscan->ndirs = ndirs;
+	i = 0;
+	foreach(lc, dirs)
+	{
+		ParallelScanDir *dir = &pscan->dirs[i];
+
+		strlcpy(dir->path, (char *) lfirst(lc), MAXPGPATH);
+		dir->helper = i % nhelpers;
+		dir->done = false;
+		dir->stat_calls = 0;
+		i++;
+	}
+	shm_toc_insert(toc, PARALLEL_SCAN_KEY_SHARED, pscan);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	sprintf(worker.bgw_library_name, "pg_quota");
+	sprintf(worker.bgw_function_name, "pg_quota_scan_helper_main");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_quota scan helper");
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	mqh = palloc0(nhelpers * sizeof(shm_mq_handle *));
+	nactive = 0;
+	for (i = 0; i < nhelpers; i++)
+	{
+		shm_mq	   *mq;
+		BackgroundWorkerHandle *handle;
+
+		mq = shm_mq_create(shm_toc_allocate(toc, PG_QUOTA_SCAN_QUEUE_SIZE),
+						   PG_QUOTA_SCAN_QUEUE_SIZE);
+		shm_toc_insert(toc, PARALLEL_SCAN_KEY_QUEUE + i, mq);
+		shm_mq_set_receiver(mq, MyProc);
+
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_quota scan helper %d for database %u",
+				 i, MyDatabaseId);
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		{
+			/* Out of worker slots. The directories are scanned serially. */
+			ereport(DEBUG1,
+					(errmsg("could not launch pg_quota scan helper"),
+					 errhint("You might need to increase max_worker_processes.")));
+			continue;
+		}
+
+		mqh[i] = shm_mq_attach(mq, seg, handle);
+		nactive++;
+	}
+
+	/*
+	 * Receive the results from the helpers, until all of them have detached
+	 * from their queues.
+	 */
+	while (nactive > 0)
+	{
+		bool		got_any = false;
+
+		for (i = 0; i < nhelpers; i++)
+		{
+			shm_mq_result res;
+			Size		nbytes;
+			void	   *data;
+			ParallelScanFile *file;
+			char		path[MAXPGPATH];
+
+			if (mqh[i] == NULL)
+				continue;
+
+			res = shm_mq_receive(mqh[i], &nbytes, &data, true);
+			if (res == SHM_MQ_WOULD_BLOCK)
+				continue;
+			if (res == SHM_MQ_DETACHED)
+			{
+				shm_mq_detach(mqh[i]);
+				mqh[i] = NULL;
+				nactive--;
+				continue;
+			}
+
+			file = (ParallelScanFile *) data;
+			if (nbytes <= offsetof(ParallelScanFile, path))
+				elog(ERROR, "invalid message from pg_quota scan helper");
+			strlcpy(path, file->path,
+					Min(MAXPGPATH, nbytes - offsetof(ParallelScanFile, path)));
+			callback(&file->rnode, path, file->size);
+			got_any = true;
+		}
+
+		if (!got_any && nactive > 0)
+		{
+			int			rc;
+
+			rc = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_POSTMASTER_DEATH,
+						   0,
+						   PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	/* The helpers are gone. Collect the directories they didn't finish. */
+	pg_read_barrier();
+	for (i = 0; i < ndirs; i++)
+	{
+		ParallelScanDir *dir = &pscan->dirs[i];
+
+		if (dir->done)
+		{
+			(*dirs_scanned)++;
+			*stat_calls += dir->stat_calls;
+		}
+		else
+			unfinished = lappend(unfinished, pstrdup(dir->path));
+	}
+
+	pfree(mqh);
+	dsm_detach(seg);
+
+	return unfinished;
+}
+
+/*
+ * In a helper, send the size of one file to the worker.
+ */
+static void
+send_file_size(RelFileNode *rnode, char *path, off_t size)
+{
+	union
+	{
+		ParallelScanFile hdr;
+		char		data[offsetof(ParallelScanFile, path) + MAXPGPATH];
+	}			buf;
+	ParallelScanFile *file = &buf.hdr;
+	int			len;
+
+	file->rnode = *rnode;
+	file->size = size;
+	len = strlcpy(file->path, path, MAXPGPATH);
+
+	if (shm_mq_send(helper_mqh, offsetof(ParallelScanFile, path) + len + 1,
+					file, false) == SHM_MQ_DETACHED)
+	{
+		/* The worker is gone, no point in continuing */
+		proc_exit(0);
+	}
+}
+
+/*
+ * Main entry point of a scan helper.
+ */
+void
+pg_quota_scan_helper_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	ParallelScanShared *pscan;
+	shm_mq	   *mq;
+	int			helperno;
+	int			i;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&helperno, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_quota scan helper");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	toc = shm_toc_attach(PG_QUOTA_SCAN_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("invalid magic number in dynamic shared memory segment")));
+
+	pscan = shm_toc_lookup(toc, PARALLEL_SCAN_KEY_SHARED, false);
+	mq = shm_toc_lookup(toc, PARALLEL_SCAN_KEY_QUEUE + helperno, false);
+	shm_mq_set_sender(mq, MyProc);
+	helper_mqh = shm_mq_attach(mq, seg, NULL);
+
+	for (i = 0; i < pscan->ndirs; i++)
+	{
+		ParallelScanDir *dir = &pscan->dirs[i];
+		DIR		   *dirdesc;
+		struct dirent *dirent;
+		int64		stat_calls = 0;
+		char		path[MAXPGPATH];
+
+		if (dir->helper != helperno)
+			continue;
+
+		StatBatchBegin(send_file_size);
+
+		dirdesc = AllocateDir(dir->path);
+		while ((dirent = ReadDirExtended(dirdesc, dir->path, DEBUG1)) != NULL)
+		{
+			RelFileNode rnode;
+
+			if (strcmp(dirent->d_name, ".") == 0 ||
+				strcmp(dirent->d_name, "..") == 0)
+				continue;
+
+			snprintf(path, MAXPGPATH, "%s/%s", dir->path, dirent->d_name);
+
+			/* Same filtering as in RebuildRelSizeMapDir() */
+			if (!isRelDataFile(path, &rnode))
+				continue;
+			if (rnode.relNode < FirstNormalObjectId)
+				continue;
+
+			stat_calls++;
+			StatBatchAdd(&rnode, path);
+		}
+		StatBatchFlush();
+		FreeDir(dirdesc);
+
+		dir->stat_calls = stat_calls;
+		pg_write_barrier();
+		dir->done = true;
+	}
+
+	/* Detaching from the queue tells the worker that we're done */
+	shm_mq_detach(helper_mqh);
+	dsm_detach(seg);
+
+	proc_exit(0);
+}
@@ -7,18 +7,127 @@ CREATE SCHEMA quota;
 
 set search_path='quota';
 
-CREATE FUNCTION get_quota_status(rolid OUT oid, space_used OUT int8, quota OUT int8)
+CREATE FUNCTION get_quota_status(rolid OUT oid, space_used OUT int8, quota OUT int8,
+                                 temp_used OUT int8, temp_quota OUT int8,
+                                 relations OUT int8, max_relations OUT int8,
+                                 files OUT int8, max_files OUT int8,
+                                 reclaimable OUT int8, free_space OUT int8)
 RETURNS SETOF record STRICT
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
 
 CREATE VIEW quota.status AS
-SELECT rolid::regrole AS rolname, space_used, quota
+SELECT rolid::regrole AS rolname, space_used, quota, temp_used, temp_quota,
+       relations, max_relations, files, max_files, reclaimable, free_space
 FROM get_quota_status();
 
--- Configuration table
-create table quota.config (roleid oid PRIMARY key, quota int8);
+CREATE FUNCTION get_relation_sizes(relid OUT oid, table_size OUT int8,
+                                   indexes_size OUT int8, toast_size OUT int8,
+                                   total_size OUT int8, reclaimable OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.relation_sizes AS
+SELECT relid::regclass AS relname, table_size, indexes_size, toast_size, total_size,
+       reclaimable
+FROM get_relation_sizes();
+
+CREATE FUNCTION get_quota_totals(kind text, objid OUT oid, space_used OUT int8, quota OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.cluster_status AS
+SELECT objid::regrole AS rolname, space_used, quota
+FROM get_quota_totals('cluster');
+
+CREATE VIEW quota.group_status AS
+SELECT objid::regrole AS rolname, space_used, quota
+FROM get_quota_totals('group');
+
+CREATE VIEW quota.schema_status AS
+SELECT objid::regnamespace AS nspname, space_used, quota
+FROM get_quota_totals('schema');
+
+CREATE VIEW quota.tablespace_status AS
+SELECT t.spcname, space_used, quota
+FROM get_quota_totals('tablespace') q
+LEFT JOIN pg_catalog.pg_tablespace t ON t.oid = q.objid;
+
+CREATE VIEW quota.database_status AS
+SELECT d.datname, space_used, quota
+FROM get_quota_totals('database') q
+LEFT JOIN pg_catalog.pg_database d ON d.oid = q.objid;
+
+CREATE FUNCTION get_scan_stats(pid OUT int4, cycles OUT int8,
+                               last_cycle_end OUT timestamptz,
+                               cycle_time OUT float8, scan_time OUT float8,
+                               sweep_time OUT float8, orphans_time OUT float8,
+                               dirs_scanned OUT int8, stat_calls OUT int8,
+                               files OUT int8, relations OUT int8,
+                               orphans OUT int8, model_bytes OUT int8,
+                               skipped_scans OUT int8)
+RETURNS record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.scan_stats AS
+SELECT * FROM get_scan_stats() WHERE pid IS NOT NULL;
+
+CREATE FUNCTION get_scan_progress(pid OUT int4, phase OUT text,
+                                  phase_start OUT timestamptz,
+                                  dirs_done OUT int8, dirs_total OUT int8,
+                                  files_done OUT int8, files_total OUT int8,
+                                  bytes_done OUT int8,
+                                  orphans_remaining OUT int8)
+RETURNS record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.scan_progress AS
+SELECT * FROM get_scan_progress() WHERE pid IS NOT NULL;
+
+CREATE FUNCTION usage_history(role regrole, sample_time OUT timestamptz,
+                              space_used OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME', 'get_usage_history'
+LANGUAGE C;
+
+CREATE FUNCTION get_usage_forecast(rolid OUT oid, space_used OUT int8, quota OUT int8,
+                                   bytes_per_hour OUT float8,
+                                   time_to_quota OUT interval)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.forecast AS
+SELECT rolid::regrole AS rolname, space_used, quota, bytes_per_hour, time_to_quota
+FROM get_usage_forecast();
+
+CREATE FUNCTION verify(sample_fraction float8 DEFAULT 0.01, repair bool DEFAULT false,
+                       rolname OUT regrole, sampled_files OUT int8,
+                       sampled_bytes OUT int8, missing_files OUT int8,
+                       size_mismatches OUT int8, owner_mismatches OUT int8,
+                       error_bytes OUT int8, estimated_error_bytes OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME', 'verify_model'
+LANGUAGE C;
+
+-- Configuration tables
+create table quota.config (roleid oid PRIMARY key, quota int8, temp_quota int8,
+                           max_relations int8, max_files int8);
+create table quota.cluster_config (roleid oid PRIMARY key, quota int8);
+create table quota.group_config (roleid oid PRIMARY key, quota int8);
+create table quota.schema_config (schemaid oid PRIMARY key, quota int8);
+create table quota.tablespace_config (spcid oid PRIMARY key, quota int8);
+create table quota.database_config (datid oid PRIMARY key, quota int8);
 
 SELECT pg_catalog.pg_extension_config_dump('quota.config', '');
+SELECT pg_catalog.pg_extension_config_dump('quota.cluster_config', '');
+SELECT pg_catalog.pg_extension_config_dump('quota.group_config', '');
+SELECT pg_catalog.pg_extension_config_dump('quota.schema_config', '');
+SELECT pg_catalog.pg_extension_config_dump('quota.tablespace_config', '');
+SELECT pg_catalog.pg_extension_config_dump('quota.database_config', '');
 
 reset search_path;
@@ -22,19 +22,33 @@
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
+#include "access/genam.h"
+#include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/dependency.h"
+#include "catalog/index.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_auth_members.h"
 #include "catalog/pg_authid_d.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_depend.h"
 #include "catalog/pg_type_d.h"
+#include "commands/async.h"
 #include "commands/dbcommands.h"
 #include "executor/spi.h"
 #include "nodes/makefuncs.h"
 #include "pgstat.h"
+#include "postmaster/postmaster.h"
+#include "utils/fmgroids.h"
 #include "utils/guc.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
 #include "utils/relfilenodemap.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "utils/varlena.h"
 
 #include "pg_quota.h"
@@ -48,10 +62,19 @@ void		pg_quota_worker_main(Datum) pg_attribute_noreturn();
 static volatile sig_atomic_t got_sighup = false;
 static volatile sig_atomic_t got_sigterm = false;
 
+/* set by syscache invalidation callback, when pg_auth_members changes */
+static bool group_membership_changed = true;
+
 /* GUC variables */
 static int	pg_quota_refresh_naptime = 10;
+static int	pg_quota_max_naptime = 0;
+static int	pg_quota_reclaimable_interval = 60;
 static int	pg_quota_restart_interval = 5;
 static char	*pg_quota_databases = "postgres";
+static char	*pg_quota_notify_thresholds = "";
+static int	pg_quota_scan_workers = 0;
+static char	*pg_quota_metrics_directory = "";
+static int	pg_quota_max_entries = 4096;
 
 /*
  * Signal handler for SIGTERM
@@ -86,72 +109,349 @@ pg_quota_sighup(SIGNAL_ARGS)
 }
 
 /*
- * Load quotas from configuration table.
+ * Syscache invalidation callback for pg_auth_members.
  */
 static void
-load_quotas(void)
+pg_quota_membership_changed(Datum arg, int cacheid, uint32 hashvalue)
 {
-	int			ret;
-	TupleDesc	tupdesc;
-	int			i;
-	RangeVar   *rv;
-	Relation	rel;
+	group_membership_changed = true;
+}
 
-	rv = makeRangeVar("quota", "config", -1);
-	rel = heap_openrv_extended(rv, AccessShareLock, true);
-	if (!rel)
+/*
+ * Parse pg_quota.notify_thresholds into a list of integers, in ascending
+ * order. Returns false if the string is malformed.
+ */
+static bool
+parse_notify_thresholds(const char *str, List **thresholds)
+{
+	char	   *rawstring = pstrdup(str);
+	List	   *elemlist;
+	List	   *result = NIL;
+	ListCell   *lc;
+
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+		return false;
+
+	foreach(lc, elemlist)
 	{
-		/* configuration table is missing. */
-		elog(LOG, "configuration table \"pg_quota.quotas\" is missing in database \"%s\"",
-			 get_database_name(MyDatabaseId));
-		return;
+		char	   *elem = (char *) lfirst(lc);
+		char	   *endptr;
+		long		threshold;
+		ListCell   *prev = NULL;
+		ListCell   *lc2;
+
+		errno = 0;
+		threshold = strtol(elem, &endptr, 10);
+		if (errno != 0 || *endptr != '\0' || threshold <= 0 || threshold > 1000)
+			return false;
+
+		/* insert in order, ignoring duplicates */
+		foreach(lc2, result)
+		{
+			if (lfirst_int(lc2) >= threshold)
+				break;
+			prev = lc2;
+		}
+		if (lc2 != NULL && lfirst_int(lc2) == threshold)
+			continue;
+		if (prev)
+			lappend_cell_int(result, prev, (int) threshold);
+		else
+			result = lcons_int((int) threshold, result);
 	}
 
-	ret = SPI_execute("select roleid, quota int8 from quota.config", true, 0);
+	*thresholds = result;
+	return true;
+}
+
+/*
+ * GUC check hook for pg_quota.notify_thresholds.
+ */
+static bool
+check_notify_thresholds(char **newval, void **extra, GucSource source)
+{
+	List	   *thresholds;
+
+	if (!parse_notify_thresholds(*newval, &thresholds))
+	{
+		GUC_check_errdetail("List must contain percentages between 1 and 1000, separated by commas.");
+		return false;
+	}
+	list_free(thresholds);
+	return true;
+}
+
+/*
+ * Load quotas of one kind from a configuration table.
+ *
+ * The query must return the object's OID, and its quota. For roles, there are
+ * three more columns: the temporary file quota, and the limits on the number
+ * of relations and files.
+ */
+static void
+load_quota_table(const char *query, QuotaKind kind)
+{
+	int			ret;
+	TupleDesc	tupdesc;
+	int			natts = (kind == QUOTA_ROLE) ? 6 : 2;
+	int			i;
+
+	ret = SPI_execute(query, true, 0);
 	if (ret != SPI_OK_SELECT)
 		elog(FATAL, "SPI_execute failed: error code %d", ret);
 
 	tupdesc = SPI_tuptable->tupdesc;
-	if (tupdesc->natts != 2 ||
-		TupleDescAttr(tupdesc, 0)->atttypid != OIDOID ||
-		TupleDescAttr(tupdesc, 1)->atttypid != INT8OID)
-		elog(ERROR, "query must yield two columns, oid and int8");
+	if (tupdesc->natts != natts ||
+		TupleDescAttr(tupdesc, 0)->atttypid != OIDOID)
+		elog(ERROR, "query must yield %d columns, oid and int8", natts);
+	for (i = 1; i < natts; i++)
+	{
+		if (TupleDescAttr(tupdesc, i)->atttypid != INT8OID)
+			elog(ERROR, "query must yield %d columns, oid and int8", natts);
+	}
 
 	for (i = 0; i < SPI_processed; i++)
 	{
 		HeapTuple	tup = SPI_tuptable->vals[i];
 		Datum		dat;
-		Oid			roleid;
-		int64		quota;
+		Oid			objid;
+		QuotaLimits limits;
 		bool		isnull;
 
 		dat = SPI_getbinval(tup, tupdesc, 1, &isnull);
 		if (isnull)
 			continue;
-		roleid = DatumGetObjectId(dat);
+		objid = DatumGetObjectId(dat);
 
+		/* NULL means no quota */
 		dat = SPI_getbinval(tup, tupdesc, 2, &isnull);
-		if (isnull)
-			continue;
-		quota = DatumGetInt64(dat);
+		limits.quota = isnull ? -1 : DatumGetInt64(dat);
+
+		limits.temp_quota = -1;
+		limits.max_relations = -1;
+		limits.max_files = -1;
+		if (kind == QUOTA_ROLE)
+		{
+			dat = SPI_getbinval(tup, tupdesc, 3, &isnull);
+			limits.temp_quota = isnull ? -1 : DatumGetInt64(dat);
+			dat = SPI_getbinval(tup, tupdesc, 4, &isnull);
+			limits.max_relations = isnull ? -1 : DatumGetInt64(dat);
+			dat = SPI_getbinval(tup, tupdesc, 5, &isnull);
+			limits.max_files = isnull ? -1 : DatumGetInt64(dat);
+		}
 
 		/* Update the model with this */
-		UpdateQuota(roleid, quota);
+		UpdateQuota(kind, objid, &limits);
+	}
+}
+
+/*
+ * Load quotas from configuration tables.
+ *
+ * Returns false if the configuration tables are missing.
+ */
+static bool
+load_quotas(void)
+{
+	RangeVar   *rv;
+	Relation	rel;
+
+	rv = makeRangeVar("quota", "config", -1);
+	rel = heap_openrv_extended(rv, AccessShareLock, true);
+	if (!rel)
+	{
+		/* configuration table is missing. */
+		elog(LOG, "configuration table \"pg_quota.quotas\" is missing in database \"%s\"",
+			 get_database_name(MyDatabaseId));
+		return false;
 	}
 
+	BeginQuotaUpdate();
+	load_quota_table("select roleid, quota, temp_quota, max_relations, max_files from quota.config",
+					 QUOTA_ROLE);
+	load_quota_table("select roleid, quota from quota.cluster_config",
+					 QUOTA_CLUSTER);
+	load_quota_table("select roleid, quota from quota.group_config",
+					 QUOTA_GROUP);
+	load_quota_table("select schemaid, quota from quota.schema_config",
+					 QUOTA_NAMESPACE);
+	load_quota_table("select spcid, quota from quota.tablespace_config",
+					 QUOTA_TABLESPACE);
+	load_quota_table("select datid, quota from quota.database_config "
+					 "where datid = (select oid from pg_database where datname = current_database())",
+					 QUOTA_DATABASE);
+	EndQuotaUpdate();
+
 	heap_close(rel, NoLock);
+
+	return true;
 }
 
 /*
- * get_relfilenode_owner
+ * Load the quota configuration, recompute the group totals, and notify of
+ * any thresholds crossed. Must be called in a transaction, connected to SPI.
+ */
+static void
+update_quotas(void)
+{
+	pgstat_report_activity(STATE_RUNNING, "loading quota configuration");
+	SetScanPhase(SCAN_PHASE_LOADING_QUOTAS);
+	load_quotas();
+
+	/*
+	 * Reset the flag first, in case it gets set again while we're reading
+	 * the catalogs.
+	 */
+	if (group_membership_changed)
+	{
+		group_membership_changed = false;
+		UpdateGroupQuotas(true);
+	}
+	else
+		UpdateGroupQuotas(false);
+
+	if (pg_quota_notify_thresholds[0] != '\0')
+	{
+		List	   *thresholds;
+
+		pgstat_report_activity(STATE_RUNNING, "checking notification thresholds");
+		if (parse_notify_thresholds(pg_quota_notify_thresholds, &thresholds))
+			NotifyThresholdCrossings(thresholds);
+	}
+}
+
+/*
+ * Bootstrap the model, before the first full scan.
  *
- *		Returns the owner OID associated with a given relation.
+ * The first full scan can take minutes on a large database, and until it
+ * has finished, the totals are incomplete, so the quotas are effectively
+ * not enforced. To get the quotas that matter back in force quickly, load
+ * the configuration first, and add just the relations owned by roles with
+ * a quota, or by members of groups with a quota, to the model. The full
+ * scan then fills in the rest.
  */
-Oid
-get_relfilenode_owner(RelFileNode *rnode)
+static void
+bootstrap_quotas(void)
+{
+	int			ret;
+	uint64		i;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	pgstat_report_activity(STATE_RUNNING, "scanning relations of roles with quotas");
+	SetScanPhase(SCAN_PHASE_BOOTSTRAP);
+
+	if (load_quotas())
+	{
+		ret = SPI_execute("with recursive groups(roleid) as ("
+						  "  select roleid from quota.group_config where quota is not null"
+						  "  union"
+						  "  select m.member from pg_catalog.pg_auth_members m, groups g"
+						  "  where m.roleid = g.roleid"
+						  ") "
+						  "select c.reltablespace, c.relfilenode from pg_catalog.pg_class c "
+						  "where c.relfilenode <> 0 and c.relpersistence <> 't' "
+						  "and c.relowner in (select roleid from quota.config where quota is not null"
+						  "                   union select roleid from quota.cluster_config where quota is not null"
+						  "                   union select roleid from groups)",
+						  true, 0);
+		if (ret != SPI_OK_SELECT)
+			elog(FATAL, "SPI_execute failed: error code %d", ret);
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			HeapTuple	tup = SPI_tuptable->vals[i];
+			TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+			bool		isnull;
+			Oid			spcid;
+			Oid			relfilenode;
+
+			spcid = DatumGetObjectId(SPI_getbinval(tup, tupdesc, 1, &isnull));
+			relfilenode = DatumGetObjectId(SPI_getbinval(tup, tupdesc, 2, &isnull));
+			if (!OidIsValid(spcid))
+				spcid = MyDatabaseTableSpace;
+
+			ScanRelationFiles(spcid, relfilenode);
+		}
+
+		elog(DEBUG1, "bootstrapped the model with " UINT64_FORMAT " relations",
+			 SPI_processed);
+
+		UpdateOrphans();
+		UpdateGroupQuotas(true);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+	SetScanPhase(SCAN_PHASE_IDLE);
+}
+
+/*
+ * Find the table that a TOAST table belongs to.
+ *
+ * There is no syscache for looking up a table by reltoastrelid, but the
+ * TOAST table has an internal dependency on the table.
+ */
+static Oid
+get_toast_parent(Oid toastrelid)
+{
+	Relation	depRel;
+	ScanKeyData key[2];
+	SysScanDesc scan;
+	HeapTuple	tup;
+	Oid			result = InvalidOid;
+
+	depRel = heap_open(DependRelationId, AccessShareLock);
+
+	ScanKeyInit(&key[0],
+				Anum_pg_depend_classid,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(RelationRelationId));
+	ScanKeyInit(&key[1],
+				Anum_pg_depend_objid,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(toastrelid));
+
+	scan = systable_beginscan(depRel, DependDependerIndexId, true,
+							  NULL, 2, key);
+	while (HeapTupleIsValid(tup = systable_getnext(scan)))
+	{
+		Form_pg_depend depform = (Form_pg_depend) GETSTRUCT(tup);
+
+		if (depform->refclassid == RelationRelationId &&
+			depform->deptype == DEPENDENCY_INTERNAL)
+		{
+			result = depform->refobjid;
+			break;
+		}
+	}
+
+	systable_endscan(scan);
+	heap_close(depRel, AccessShareLock);
+
+	return result;
+}
+
+/*
+ * get_relfilenode_info
+ *
+ *		Looks up the relation associated with a given relfilenode, its owner,
+ *		and the table that its size is rolled up to. Returns false if the
+ *		relation is not found.
+ */
+bool
+get_relfilenode_info(RelFileNode *rnode, RelFileInfo *info)
 {
 	Oid			relid;
 	HeapTuple	tp;
+	Form_pg_class reltup;
+	char		relkind;
 
 	Assert(rnode->dbNode == MyDatabaseId);
 	relid = RelidByRelfilenode(rnode->spcNode, rnode->relNode);
@@ -159,24 +459,90 @@ get_relfilenode_owner(RelFileNode *rnode)
 	{
 		elog(DEBUG1, "could not find pg_class entry for relation %u/%u/%u",
 			 rnode->dbNode, rnode->spcNode, rnode->relNode);
-		return InvalidOid;
+		return false;
 	}
 
 	tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
-	if (HeapTupleIsValid(tp))
+	if (!HeapTupleIsValid(tp))
 	{
-		Form_pg_class reltup = (Form_pg_class) GETSTRUCT(tp);
-		Oid			result;
-
-		result = reltup->relowner;
-		ReleaseSysCache(tp);
-		return result;
+		elog(DEBUG1, "could not find owner for relation %u", relid);
+		return false;
+	}
+	reltup = (Form_pg_class) GETSTRUCT(tp);
+	info->relid = relid;
+	info->owner = reltup->relowner;
+	info->namespace = reltup->relnamespace;
+	relkind = reltup->relkind;
+	ReleaseSysCache(tp);
+
+	if (!OidIsValid(info->owner))
+		return false;
+
+	/* Indexes are rolled up to their table */
+	if (relkind == RELKIND_INDEX)
+	{
+		info->kind = RELSIZE_INDEX;
+		info->toprelid = IndexGetRelation(relid, true);
+		if (!OidIsValid(info->toprelid))
+			info->toprelid = relid;
 	}
 	else
 	{
-		elog(DEBUG1, "could not find owner for relation %u", relid);
-		return InvalidOid;
+		info->kind = RELSIZE_TABLE;
+		info->toprelid = relid;
 	}
+
+	/* And TOAST tables, and their indexes, to the table that owns them */
+	if (get_rel_relkind(info->toprelid) == RELKIND_TOASTVALUE)
+	{
+		Oid			parentrelid = get_toast_parent(info->toprelid);
+
+		if (OidIsValid(parentrelid))
+		{
+			info->kind = RELSIZE_TOAST;
+			info->toprelid = parentrelid;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * get_role_members
+ *
+ *		Returns a list of all roles that are members of the given role,
+ *		directly or indirectly, including the role itself.
+ */
+List *
+get_role_members(Oid groupid)
+{
+	List	   *result = list_make1_oid(groupid);
+	ListCell   *lc;
+
+	/*
+	 * The list grows as we go, so this walks the whole membership tree, like
+	 * roles_is_member_of() does in the other direction.
+	 */
+	foreach(lc, result)
+	{
+		Oid			roleid = lfirst_oid(lc);
+		CatCList   *memlist;
+		int			i;
+
+		memlist = SearchSysCacheList1(AUTHMEMROLEMEM,
+									  ObjectIdGetDatum(roleid));
+		for (i = 0; i < memlist->n_members; i++)
+		{
+			HeapTuple	tup = &memlist->members[i]->tuple;
+			Oid			member = ((Form_pg_auth_members) GETSTRUCT(tup))->member;
+
+			if (!list_member_oid(result, member))
+				result = lappend_oid(result, member);
+		}
+		ReleaseSysCacheList(memlist);
+	}
+
+	return result;
 }
 
 /*
@@ -186,6 +552,12 @@ void
 pg_quota_worker_main(Datum main_arg)
 {
 	char	   *dbname = MyBgworkerEntry->bgw_extra;
+	int			slotno = DatumGetInt32(main_arg);
+	bool		scanned = false;
+	bool		reloaded = false;
+	int			naptime;
+	TimestampTz last_full_scan = 0;
+	TimestampTz last_reclaimable = 0;
 
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, pg_quota_sighup);
@@ -197,22 +569,42 @@ pg_quota_worker_main(Datum main_arg)
 	/* Connect to our database */
 	BackgroundWorkerInitializeConnection(dbname, NULL, 0);
 
-	elog(LOG, "%s initialized",
-		 MyBgworkerEntry->bgw_name);
+	/*
+	 * On a hot standby, we start as soon as the standby is consistent. The
+	 * worker only reads the catalogs and the configuration tables, which is
+	 * allowed in recovery, so it works the same as on the primary, with the
+	 * quotas replicated from the primary's configuration tables.
+	 */
+	if (RecoveryInProgress())
+		elog(LOG, "%s initialized, in hot standby mode",
+			 MyBgworkerEntry->bgw_name);
+	else
+		elog(LOG, "%s initialized",
+			 MyBgworkerEntry->bgw_name);
 
 	/*
-	 * Initialize the model and set the latch to refresh the model for the first
-	 * time without waiting.
+	 * Initialize the model, bootstrap it with the relations that have quotas,
+	 * and set the latch to refresh the model for the first time without
+	 * waiting.
 	 */
-	init_fs_model();
+	init_fs_model(slotno);
+	bootstrap_quotas();
 	SetLatch(MyLatch);
 
+	/* Rebuild the group membership closure whenever pg_auth_members changes */
+	CacheRegisterSyscacheCallback(AUTHMEMROLEMEM,
+								  pg_quota_membership_changed,
+								  (Datum) 0);
+
 	/*
 	 * Main loop: do this until the SIGTERM handler tells us to terminate
 	 */
+	naptime = pg_quota_refresh_naptime;
 	while (!got_sigterm)
 	{
 		int			rc;
+		bool		probe;
+		bool		force;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
@@ -220,9 +612,10 @@ pg_quota_worker_main(Datum main_arg)
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
 		 */
+		SetHibernating(naptime > pg_quota_refresh_naptime);
 		rc = WaitLatch(MyLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pg_quota_refresh_naptime * 1000L,
+					   naptime * 1000L,
 					   PG_WAIT_EXTENSION);
 		ResetLatch(MyLatch);
 
@@ -239,13 +632,91 @@ pg_quota_worker_main(Datum main_arg)
 		{
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
+			reloaded = true;
 		}
 
 		/*
-		 * Rescan the data directory.
+		 * Serve a quota.verify() request. This is done before the rescan,
+		 * which would fix the very discrepancies the audit is looking for.
+		 * If that's all we were woken up for, go back to sleep without
+		 * rescanning.
 		 */
+		if (VerifyRequested())
+		{
+			SetCurrentStatementStartTimestamp();
+			StartTransactionCommand();
+			PushActiveSnapshot(GetTransactionSnapshot());
+			pgstat_report_activity(STATE_RUNNING, "verifying model");
+			SetScanPhase(SCAN_PHASE_VERIFYING);
+
+			VerifyModel();
+
+			PopActiveSnapshot();
+			CommitTransactionCommand();
+			pgstat_report_activity(STATE_IDLE, NULL);
+			SetScanPhase(SCAN_PHASE_IDLE);
+
+			if (!(rc & WL_TIMEOUT) && scanned)
+				continue;
+		}
+
+		/*
+		 * If we were hibernating, and a backend woke us up because it's about
+		 * to write, go back to the normal naptime. Whatever it writes will be
+		 * there by the next cycle.
+		 */
+		if (naptime > pg_quota_refresh_naptime && !SetHibernating(false))
+		{
+			naptime = pg_quota_refresh_naptime;
+			continue;
+		}
+
+		/*
+		 * Rescan the data directory. With pg_quota.max_naptime, probe for
+		 * changes first, and if there were none, skip the scan and sleep
+		 * twice as long as last time, up to max_naptime. A full scan is done
+		 * at least every max_naptime anyway, to catch what the probe can't
+		 * see.
+		 */
+		probe = (pg_quota_max_naptime > pg_quota_refresh_naptime);
+		force = (!scanned ||
+				 TimestampDifferenceExceeds(last_full_scan,
+											GetCurrentTimestamp(),
+											pg_quota_max_naptime * 1000));
+
 		pgstat_report_activity(STATE_RUNNING, "scanning datadir");
-		refresh_fs_model();
+		if (!refresh_fs_model(pg_quota_scan_workers, probe, force))
+		{
+			naptime = Min(naptime * 2, pg_quota_max_naptime);
+
+			/*
+			 * A reload, or a change in group memberships, doesn't touch this
+			 * database's files, but may change the quotas. Those are
+			 * recomputed from the totals we have, without a scan.
+			 */
+			if (reloaded || group_membership_changed)
+			{
+				SetCurrentStatementStartTimestamp();
+				StartTransactionCommand();
+				SPI_connect();
+				PushActiveSnapshot(GetTransactionSnapshot());
+
+				update_quotas();
+
+				SPI_finish();
+				PopActiveSnapshot();
+				CommitTransactionCommand();
+				ProcessCompletedNotifies();
+				SetScanPhase(SCAN_PHASE_IDLE);
+			}
+			reloaded = false;
+			pgstat_report_activity(STATE_IDLE, NULL);
+			continue;
+		}
+		naptime = pg_quota_refresh_naptime;
+		reloaded = false;
+		last_full_scan = GetCurrentTimestamp();
+		scanned = true;
 
 		/*
 		 * Start a transaction on which we can run queries.  Note that each
@@ -269,6 +740,7 @@ pg_quota_worker_main(Datum main_arg)
 		PushActiveSnapshot(GetTransactionSnapshot());
 
 		pgstat_report_activity(STATE_RUNNING, "scanning pg_class");
+		SetScanPhase(SCAN_PHASE_RESOLVING_OWNERS);
 
 		/*
 		 * If there are any relfilenodes for which we don't know the owner, look
@@ -276,8 +748,26 @@ pg_quota_worker_main(Datum main_arg)
 		 */
 		UpdateOrphans();
 
-		pgstat_report_activity(STATE_RUNNING, "loading quota configuration");
-		load_quotas();
+		/*
+		 * Re-estimating the reclaimable space reads the free space maps of
+		 * every table that has changed, so it's done less often than the
+		 * scans.
+		 */
+		if (TimestampDifferenceExceeds(last_reclaimable,
+									   GetCurrentTimestamp(),
+									   pg_quota_reclaimable_interval * 1000))
+		{
+			pgstat_report_activity(STATE_RUNNING, "estimating reclaimable space");
+			SetScanPhase(SCAN_PHASE_ESTIMATING_RECLAIMABLE);
+			UpdateReclaimableSpace();
+			last_reclaimable = GetCurrentTimestamp();
+		}
+
+		pgstat_report_activity(STATE_RUNNING, "publishing relation sizes");
+		SetScanPhase(SCAN_PHASE_PUBLISHING);
+		PublishRelationSizes();
+
+		update_quotas();
 
 		/*
 		 * And finish our transaction.
@@ -285,8 +775,33 @@ pg_quota_worker_main(Datum main_arg)
 		SPI_finish();
 		PopActiveSnapshot();
 		CommitTransactionCommand();
+
+		/*
+		 * Signal the listeners of any notifications we sent. A regular
+		 * backend does this in its main loop, but a background worker has to
+		 * do it itself.
+		 */
+		ProcessCompletedNotifies();
+
+		PublishScanStats();
+
+		/*
+		 * Write the metrics file. This needs a transaction of its own, to
+		 * look up the role names, because the scan statistics are only
+		 * complete after the main transaction.
+		 */
+		if (pg_quota_metrics_directory[0] != '\0')
+		{
+			pgstat_report_activity(STATE_RUNNING, "writing metrics file");
+			SetCurrentStatementStartTimestamp();
+			StartTransactionCommand();
+			WriteMetricsFile(pg_quota_metrics_directory);
+			CommitTransactionCommand();
+		}
+
 		pgstat_report_stat(false);
 		pgstat_report_activity(STATE_IDLE, NULL);
+		SetScanPhase(SCAN_PHASE_IDLE);
 	}
 
 	proc_exit(1);
@@ -304,14 +819,12 @@ _PG_init(void)
 	ListCell   *lc;
 	char	   *dbstr;
 	List	   *dblist;
+	int			slotno;
 
 	/* This initialization must happen at postmaster startup. */
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
-	init_fs_model_shmem();
-	init_quota_enforcement();
-
 	/* Get the configuration */
 	DefineCustomIntVariable("pg_quota.refresh_naptime",
 							"Duration between each full scan of datadir (in seconds).",
@@ -326,6 +839,32 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("pg_quota.max_naptime",
+							"Longest delay between scans of an idle database (in seconds).",
+							"If it's larger than pg_quota.refresh_naptime, the worker skips scans when a quick probe sees no changes, backing off up to this delay.",
+							&pg_quota_max_naptime,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.reclaimable_interval",
+							"How often to re-estimate the reclaimable space (in seconds).",
+							"0 re-estimates it in every cycle.",
+							&pg_quota_reclaimable_interval,
+							60,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_quota.restart_interval",
 							"How long to wait after a worker crash before restart (in seconds).",
 							NULL,
@@ -353,11 +892,58 @@ _PG_init(void)
 							   NULL,
 							   NULL);
 
+	DefineCustomIntVariable("pg_quota.max_entries",
+							"Maximum number of usage totals kept in shared memory.",
+							"One is needed for each role, group, schema and tablespace with relations in each database, and for each role and database as a whole.",
+							&pg_quota_max_entries,
+							4096,
+							64,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.scan_workers",
+							"Number of helper workers to scan the tablespaces of a database in parallel.",
+							"0 scans them serially, in the worker itself.",
+							&pg_quota_scan_workers,
+							0,
+							0,
+							MAX_BACKENDS,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_quota.notify_thresholds",
+							   "Percentages of quota at which to send notifications.",
+							   "A comma-separated list, like \"80,95,100\". Empty disables notifications.",
+							   &pg_quota_notify_thresholds,
+							   "",
+							   PGC_SIGHUP, GUC_LIST_INPUT,
+							   check_notify_thresholds,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_quota.metrics_directory",
+							   "Directory to write Prometheus metrics files to.",
+							   "Empty disables writing them.",
+							   &pg_quota_metrics_directory,
+							   "",
+							   PGC_SIGHUP, 0,
+							   NULL,
+							   NULL,
+							   NULL);
+
 	/* set up common data for all our workers */
 	memset(&worker, 0, sizeof(worker));
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
 		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	/* Start during recovery too, to track usage on hot standbys */
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
 	worker.bgw_restart_time = pg_quota_restart_interval;
 	sprintf(worker.bgw_library_name, "pg_quota");
 	sprintf(worker.bgw_function_name, "pg_quota_worker_main");
@@ -379,6 +965,12 @@ _PG_init(void)
 		elog(ERROR, "invalid list syntax in pg_quota.databases setting");
 	}
 
+	/* Each database gets a slot in shared memory. */
+	init_fs_model_shmem(list_length(dblist), pg_quota_max_entries);
+	init_quota_enforcement();
+	init_relation_hooks();
+
+	slotno = 0;
 	foreach(lc, dblist)
 	{
 		char	   *dbname = (char *) lfirst(lc);
@@ -386,6 +978,7 @@ _PG_init(void)
 		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_quota worker for \"%s\"", dbname);
 		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_quota worker");
 		snprintf(worker.bgw_extra, BGW_EXTRALEN, "%s", dbname);
+		worker.bgw_main_arg = Int32GetDatum(slotno++);
 
 		RegisterBackgroundWorker(&worker);
 	}
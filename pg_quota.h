@@ -5,23 +5,122 @@
 #ifndef PG_QUOTA_H
 #define PG_QUOTA_H
 
+#include "nodes/pg_list.h"
 #include "storage/relfilenode.h"
 
+/*
+ * Kinds of objects that quotas can be set on.
+ */
+typedef enum QuotaKind
+{
+	QUOTA_ROLE,					/* relations owned by a role */
+	QUOTA_GROUP,				/* relations owned by members of a role */
+	QUOTA_CLUSTER,				/* relations owned by a role, in all databases */
+	QUOTA_NAMESPACE,			/* relations in a schema */
+	QUOTA_TABLESPACE,			/* relations in a tablespace */
+	QUOTA_DATABASE				/* all files of a database */
+} QuotaKind;
+
+/*
+ * Limits loaded from the configuration tables. -1 means no limit.
+ */
+typedef struct QuotaLimits
+{
+	int64		quota;			/* disk space */
+	int64		temp_quota;		/* temporary files, for roles only */
+	int64		max_relations;	/* number of relations, for roles only */
+	int64		max_files;		/* number of segment files, for roles only */
+} QuotaLimits;
+
+/*
+ * How the size of a relation is rolled up to its table, in the
+ * quota.relation_sizes view.
+ */
+typedef enum RelSizeKind
+{
+	RELSIZE_TABLE,				/* the table itself */
+	RELSIZE_INDEX,				/* an index of the table */
+	RELSIZE_TOAST				/* the table's TOAST table, or its index */
+} RelSizeKind;
+
+/*
+ * Phases of the worker's cycle, for the quota.scan_progress view.
+ */
+typedef enum ScanPhase
+{
+	SCAN_PHASE_IDLE,
+	SCAN_PHASE_BOOTSTRAP,		/* adding the relations of roles with quotas */
+	SCAN_PHASE_SCANNING,		/* walking the directories */
+	SCAN_PHASE_SWEEPING,		/* removing files that were not seen */
+	SCAN_PHASE_RESOLVING_OWNERS,	/* looking up owners of new relations */
+	SCAN_PHASE_ESTIMATING_RECLAIMABLE,	/* reading free space maps */
+	SCAN_PHASE_PUBLISHING,		/* publishing relation sizes */
+	SCAN_PHASE_LOADING_QUOTAS,	/* reading the configuration tables */
+	SCAN_PHASE_VERIFYING		/* serving quota.verify() */
+} ScanPhase;
+
+/*
+ * Information about a relfilenode, looked up from the catalogs.
+ */
+typedef struct RelFileInfo
+{
+	Oid			relid;			/* pg_class OID of the relation */
+	Oid			owner;			/* owner of the relation */
+	Oid			namespace;		/* schema of the relation */
+	Oid			toprelid;		/* table the relation is rolled up to */
+	RelSizeKind kind;
+} RelFileInfo;
+
 /* prototypes for pg_quota.c */
-extern Oid get_relfilenode_owner(RelFileNode *rnode);
+extern bool get_relfilenode_info(RelFileNode *rnode, RelFileInfo *info);
+extern List *get_role_members(Oid groupid);
 
 /* prototypes for fs_model.c */
-extern void init_fs_model(void);
-extern void init_fs_model_shmem(void);
-extern void refresh_fs_model(void);
+extern void init_fs_model(int slotno);
+extern void init_fs_model_shmem(int ndatabases, int max_entries);
+extern bool refresh_fs_model(int scan_workers, bool probe, bool force);
+extern bool isRelDataFile(const char *path, RelFileNode *rnode);
+extern void ScanRelationFiles(Oid spcid, Oid relfilenode);
 
 extern void UpdateRelOwner(RelFileNode *rnode, Oid owner);
 extern void UpdateOrphans(void);
+extern void UpdateReclaimableSpace(void);
+extern void PublishRelationSizes(void);
+extern void PublishScanStats(void);
+extern void SetScanPhase(ScanPhase phase);
+extern void WriteMetricsFile(const char *dir);
 
-extern bool CheckQuota(Oid owner);
-extern void UpdateQuota(Oid owner, int64 newquota);
+extern bool CheckQuota(Oid owner, Oid nspid, Oid spcid, Oid headroom_relid,
+		   QuotaKind *violated);
+extern long GetThrottleDelay(Oid owner, int threshold, int max_delay);
+extern bool CheckCountQuota(Oid owner, bool *files);
+extern void BeginQuotaUpdate(void);
+extern void UpdateQuota(QuotaKind kind, Oid objid, QuotaLimits *limits);
+extern void EndQuotaUpdate(void);
+extern void UpdateGroupQuotas(bool membership_changed);
+extern void NotifyThresholdCrossings(List *thresholds);
+extern void RegisterRelFileNode(RelFileNode *rnode, RelFileInfo *info);
+extern bool VerifyRequested(void);
+extern bool SetHibernating(bool hibernating);
+extern void WakeIdleWorker(void);
+extern void VerifyModel(void);
+
+/* prototypes for parallel_scan.c */
+typedef void (*ScanFileCallback) (RelFileNode *rnode, char *path, off_t size);
+
+extern List *ParallelScanDirs(List *dirs, int nworkers, ScanFileCallback callback,
+				 int64 *dirs_scanned, int64 *stat_calls);
+
+/* prototypes for stat_batch.c */
+extern void StatBatchBegin(ScanFileCallback callback);
+extern void StatBatchAdd(RelFileNode *rnode, const char *path);
+extern void StatBatchFlush(void);
 
 /* prototypes for enforcement.c */
 extern void init_quota_enforcement(void);
 
+/* prototypes for relation_hooks.c */
+extern void init_relation_hooks(void);
+extern void RegisterRewrittenRelations(Node *parsetree);
+
 #endif							/* PG_QUOTA_H */
@@ -0,0 +1,286 @@
+/* -------------------------------------------------------------------------
+ *
+ * relation_hooks.c
+ *		Tell the worker about new relfilenodes, as they're created.
+ *
+ * The worker finds the owner of each new relfilenode in pg_class. But the
+ * pg_class row of a relation created, or truncated or rewritten, in a
+ * transaction that hasn't committed yet isn't visible to the worker, so a
+ * table that's created and bulk-loaded in one transaction would not count
+ * towards anyone's quota until the transaction commits.
+ *
+ * To close that gap, the backend registers each relfilenode it creates,
+ * with its owner, in a map in shared memory, and the worker picks them up
+ * from there instead of looking them up in pg_class. New tables, sequences
+ * and TOAST tables are caught with the object access hook. New indexes, and
+ * relations that get a new relfilenode, by TRUNCATE, CLUSTER, VACUUM FULL,
+ * REINDEX or a table rewrite in ALTER TABLE, are registered after the
+ * utility command has run.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/transam.h"
+#include "catalog/namespace.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_namespace.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+
+#include "pg_quota.h"
+
+static void quota_object_access(ObjectAccessType access, Oid classId,
+					Oid objectId, int subId, void *arg);
+
+static object_access_hook_type prev_object_access_hook;
+static bool object_access_hook_installed = false;
+
+/*
+ * Install the object access hook.
+ */
+void
+init_relation_hooks(void)
+{
+	if (!object_access_hook_installed)
+	{
+		prev_object_access_hook = object_access_hook;
+		object_access_hook = quota_object_access;
+		object_access_hook_installed = true;
+	}
+}
+
+/*
+ * Register the relfilenode of one relation, if it has storage that the
+ * worker tracks.
+ */
+static void
+register_relation(Relation rel)
+{
+	Form_pg_class relform = rel->rd_rel;
+	RelFileInfo info;
+
+	/* Relations without storage, temporary and system relations are not tracked */
+	if (relform->relkind != RELKIND_RELATION &&
+		relform->relkind != RELKIND_INDEX &&
+		relform->relkind != RELKIND_SEQUENCE &&
+		relform->relkind != RELKIND_TOASTVALUE &&
+		relform->relkind != RELKIND_MATVIEW)
+		return;
+	if (relform->relpersistence == RELPERSISTENCE_TEMP)
+		return;
+	if (rel->rd_node.dbNode != MyDatabaseId ||
+		rel->rd_node.relNode < FirstNormalObjectId)
+		return;
+
+	info.relid = RelationGetRelid(rel);
+	info.owner = relform->relowner;
+	info.namespace = relform->relnamespace;
+
+	/* Roll up indexes to their table, and TOAST tables to their parent */
+	if (relform->relkind == RELKIND_INDEX)
+	{
+		info.kind = RELSIZE_INDEX;
+		info.toprelid = rel->rd_index->indrelid;
+	}
+	else
+	{
+		info.kind = RELSIZE_TABLE;
+		info.toprelid = info.relid;
+	}
+
+	/*
+	 * The dependency of a TOAST table on its parent isn't recorded yet when
+	 * it's created, but the parent's OID is in the names of the TOAST table
+	 * and its index, "pg_toast_<OID>" and "pg_toast_<OID>_index".
+	 */
+	if (relform->relnamespace == PG_TOAST_NAMESPACE)
+	{
+		Oid			parentrelid;
+
+		if (sscanf(NameStr(relform->relname), "pg_toast_%u", &parentrelid) == 1)
+		{
+			info.kind = RELSIZE_TOAST;
+			info.toprelid = parentrelid;
+		}
+	}
+
+	RegisterRelFileNode(&rel->rd_node, &info);
+}
+
+/*
+ * Register the relfilenodes of a relation, its indexes, and its TOAST table
+ * and the TOAST table's index.
+ */
+static void
+register_relation_tree(Oid relid)
+{
+	Relation	rel;
+	List	   *indexes;
+	ListCell   *lc;
+	Oid			toastrelid;
+
+	rel = RelationIdGetRelation(relid);
+	if (!RelationIsValid(rel))
+		return;
+
+	register_relation(rel);
+	indexes = (rel->rd_rel->relkind == RELKIND_INDEX) ? NIL :
+		RelationGetIndexList(rel);
+	toastrelid = rel->rd_rel->reltoastrelid;
+	RelationClose(rel);
+
+	foreach(lc, indexes)
+		register_relation_tree(lfirst_oid(lc));
+	list_free(indexes);
+
+	if (OidIsValid(toastrelid))
+		register_relation_tree(toastrelid);
+}
+
+/*
+ * Register a relation named in a utility statement, and if 'inh', its
+ * partitions or inheritance children.
+ */
+static void
+register_rangevar(RangeVar *rv, bool inh)
+{
+	Oid			relid;
+
+	relid = RangeVarGetRelid(rv, NoLock, true);
+	if (!OidIsValid(relid))
+		return;
+
+	if (inh)
+	{
+		List	   *rels = find_all_inheritors(relid, NoLock, NULL);
+		ListCell   *lc;
+
+		foreach(lc, rels)
+			register_relation_tree(lfirst_oid(lc));
+		list_free(rels);
+	}
+	else
+		register_relation_tree(relid);
+}
+
+/*
+ * Register the relations that a utility statement created, or gave new
+ * relfilenodes. Called from the ProcessUtility hook, after the statement has
+ * run.
+ *
+ * CLUSTER and VACUUM FULL without a table name commit after each table, so
+ * for them this is not needed, nor done.
+ */
+void
+RegisterRewrittenRelations(Node *parsetree)
+{
+	ListCell   *lc;
+
+	switch (nodeTag(parsetree))
+	{
+		case T_CreateStmt:
+			/* The indexes of PRIMARY KEY and UNIQUE constraints, and TOAST */
+			register_rangevar(((CreateStmt *) parsetree)->relation, false);
+			break;
+
+		case T_CreateTableAsStmt:
+			/* The TOAST table's index */
+			register_rangevar(((CreateTableAsStmt *) parsetree)->into->rel, false);
+			break;
+
+		case T_IndexStmt:
+			register_rangevar(((IndexStmt *) parsetree)->relation,
+							  ((IndexStmt *) parsetree)->relation->inh);
+			break;
+
+		case T_TruncateStmt:
+			foreach(lc, ((TruncateStmt *) parsetree)->relations)
+			{
+				RangeVar   *rv = (RangeVar *) lfirst(lc);
+
+				register_rangevar(rv, rv->inh);
+			}
+			break;
+
+		case T_ClusterStmt:
+			if (((ClusterStmt *) parsetree)->relation)
+				register_rangevar(((ClusterStmt *) parsetree)->relation, false);
+			break;
+
+		case T_VacuumStmt:
+			{
+				VacuumStmt *vacstmt = (VacuumStmt *) parsetree;
+
+				if ((vacstmt->options & VACOPT_FULL) == 0)
+					break;
+				foreach(lc, vacstmt->rels)
+				{
+					VacuumRelation *vrel = (VacuumRelation *) lfirst(lc);
+
+					if (vrel->relation)
+						register_rangevar(vrel->relation, false);
+				}
+			}
+			break;
+
+		case T_ReindexStmt:
+			{
+				ReindexStmt *reindexstmt = (ReindexStmt *) parsetree;
+
+				if (reindexstmt->relation &&
+					(reindexstmt->kind == REINDEX_OBJECT_TABLE ||
+					 reindexstmt->kind == REINDEX_OBJECT_INDEX))
+					register_rangevar(reindexstmt->relation, false);
+			}
+			break;
+
+		case T_AlterTableStmt:
+			/* We don't know which subcommands rewrote it, so register it anyway */
+			register_rangevar(((AlterTableStmt *) parsetree)->relation,
+							  ((AlterTableStmt *) parsetree)->relation->inh);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Object access hook. Registers the relfilenode of each new relation, except
+ * indexes.
+ *
+ * The pg_class row of the new relation isn't visible to catalog lookups
+ * yet, not even in this transaction, but its relcache entry has been built
+ * already. For an index, the hook runs before the pg_index row has been
+ * inserted, so rd_index is not set yet, and the table it belongs to isn't
+ * known. Indexes are registered by RegisterRewrittenRelations() instead,
+ * after the statement that created them.
+ */
+static void
+quota_object_access(ObjectAccessType access, Oid classId,
+					Oid objectId, int subId, void *arg)
+{
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access == OAT_POST_CREATE &&
+		classId == RelationRelationId &&
+		subId == 0)
+	{
+		Relation	rel = RelationIdGetRelation(objectId);
+
+		/* A new relation has no indexes or TOAST table yet */
+		if (RelationIsValid(rel))
+		{
+			if (rel->rd_rel->relkind != RELKIND_INDEX)
+				register_relation(rel);
+			RelationClose(rel);
+		}
+	}
+}
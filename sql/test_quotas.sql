@@ -13,6 +13,9 @@ select pg_sleep(5);
 -- Display the table size.
 select pg_size_pretty(pg_total_relation_size('qt'));
 
+-- The worker publishes the same size in quota.relation_sizes
+select relname, pg_size_pretty(total_size) from quota.relation_sizes where relname = 'qt'::regclass;
+
 -- The "disk space used" as shown in quota_status should match
 SELECT rolname,
        pg_size_pretty(space_used) as used,
@@ -63,3 +66,130 @@ FROM quota.status
 WHERE rolname::text like 'quotatest%';
 
 INSERT INTO qt SELECT repeat('x', 100) FROM generate_series(1, 100000);
+
+-- Limit the number of relations the user can own. The user already owns
+-- qt and its TOAST table and index, so creating another table fails.
+UPDATE quota.config SET max_relations = 1
+WHERE roleid = 'quotatest_user'::regrole;
+
+select pg_sleep(5);
+
+SET ROLE quotatest_user;
+CREATE TABLE qt_count (i int);
+RESET ROLE;
+
+-- Lift the limit, and it works again.
+UPDATE quota.config SET max_relations = NULL
+WHERE roleid = 'quotatest_user'::regrole;
+
+select pg_sleep(5);
+
+SET ROLE quotatest_user;
+CREATE TABLE qt_count (i int);
+RESET ROLE;
+DROP TABLE qt_count;
+
+-- The user is using more than half of its quota, so the worker has already
+-- sent an "up" notification for the 50% threshold, with no one listening.
+-- Raise the quota, and listen for the notification that usage fell below
+-- it. psql prints the notification with the worker's PID, so capture it in
+-- a file and check only the stable parts of the payload.
+LISTEN pg_quota;
+\o results/test_quotas_notify.out
+UPDATE quota.config SET quota = pg_size_bytes('100 MB')
+WHERE roleid = 'quotatest_user'::regrole;
+select pg_sleep(5);
+select 1;
+\o
+UNLISTEN pg_quota;
+
+CREATE TEMP TABLE notifications (line text);
+\copy notifications from 'results/test_quotas_notify.out'
+SELECT p->>'kind' AS kind, p->>'name' AS name, p->>'threshold' AS threshold,
+       p->>'direction' AS direction, p->>'quota' AS quota
+FROM (SELECT substring(line from 'with payload "(.*)" received from')::json AS p
+      FROM notifications
+      WHERE line LIKE 'Asynchronous notification "pg_quota"%') n;
+
+-- The free space in the role's tables, and the space VACUUM would free,
+-- are estimates, so check just that they are shown. The INSERT is within
+-- the space quota, and works.
+INSERT INTO qt SELECT repeat('x', 100) FROM generate_series(1, 1000);
+
+SELECT rolname,
+       reclaimable >= 0 as reclaimable,
+       free_space >= 0 as free_space
+FROM quota.status
+WHERE rolname::text like 'quotatest%';
+
+-- Kill the worker. The postmaster starts a new one after
+-- pg_quota.restart_interval, which rebuilds the model from scratch, so
+-- quota.status shows the same usage as before. (This doesn't tell the
+-- bootstrap of the new worker apart from its first full scan.)
+CREATE TEMP TABLE old_worker AS SELECT pid FROM quota.scan_stats;
+SELECT count(pg_terminate_backend(pid)) FROM old_worker;
+
+select pg_sleep(5);
+
+SELECT count(*) AS restarted
+FROM quota.scan_stats s, old_worker o
+WHERE s.pid <> o.pid;
+
+SELECT rolname,
+       pg_size_pretty(space_used) as used,
+       pg_size_pretty(quota) as quota
+FROM quota.status
+WHERE rolname::text like 'quotatest%';
+
+-- A table created and loaded in a transaction counts toward the quota
+-- before the transaction commits: the creating backend tells the worker
+-- who owns the new files, so they are not left as orphans until commit.
+UPDATE quota.config SET quota = pg_size_bytes('20 MB')
+WHERE roleid = 'quotatest_user'::regrole;
+select pg_sleep(5);
+BEGIN;
+SET ROLE quotatest_user;
+CREATE TABLE qt_txn (t text);
+INSERT INTO qt_txn SELECT repeat('x', 100) FROM generate_series(1, 100000);
+select pg_sleep(5);
+INSERT INTO qt_txn VALUES ('x');
+ROLLBACK;
+UPDATE quota.config SET quota = pg_size_bytes('100 MB')
+WHERE roleid = 'quotatest_user'::regrole;
+
+-- Each kind of quota has its own error message. Give each one in turn a
+-- quota smaller than what qt already uses, and try to insert.
+INSERT INTO quota.schema_config VALUES ('public'::regnamespace, pg_size_bytes('1 MB'));
+select pg_sleep(5);
+INSERT INTO qt VALUES ('x');
+DELETE FROM quota.schema_config;
+INSERT INTO quota.tablespace_config
+SELECT oid, pg_size_bytes('1 MB') FROM pg_tablespace WHERE spcname = 'pg_default';
+select pg_sleep(5);
+INSERT INTO qt VALUES ('x');
+DELETE FROM quota.tablespace_config;
+INSERT INTO quota.database_config
+SELECT oid, pg_size_bytes('1 MB') FROM pg_database WHERE datname = current_database();
+select pg_sleep(5);
+INSERT INTO qt VALUES ('x');
+DELETE FROM quota.database_config;
+CREATE ROLE quotatest_group NOLOGIN;
+GRANT quotatest_group TO quotatest_user;
+INSERT INTO quota.group_config VALUES ('quotatest_group'::regrole, pg_size_bytes('1 MB'));
+select pg_sleep(5);
+INSERT INTO qt VALUES ('x');
+DELETE FROM quota.group_config;
+REVOKE quotatest_group FROM quotatest_user;
+DROP ROLE quotatest_group;
+INSERT INTO quota.cluster_config VALUES ('quotatest_user'::regrole, pg_size_bytes('1 MB'));
+select pg_sleep(5);
+INSERT INTO qt VALUES ('x');
+DELETE FROM quota.cluster_config;
+select pg_sleep(5);
+INSERT INTO qt VALUES ('x');
+
+-- Audit the model. Every file of qt is sampled, and found with the right
+-- owner. (Sizes are not checked here, autovacuum may change them.)
+SELECT rolname, sampled_files > 0 AS sampled, missing_files, owner_mismatches
+FROM quota.verify(1.0)
+WHERE rolname = 'quotatest_user'::regrole;
@@ -0,0 +1,231 @@
+/* -------------------------------------------------------------------------
+ *
+ * stat_batch.c
+ *		Get the sizes of relation files, in batches.
+ *
+ * The directory scanner needs the size of every relation file. On storage
+ * with high metadata latency, like network-attached or encrypted volumes,
+ * issuing one synchronous stat() after another makes the scan take the sum
+ * of all those latencies. When built with liburing, we instead queue
+ * statx(STATX_SIZE) requests for a whole batch of files to an io_uring, and
+ * process the completions as they come, keeping the whole batch in flight.
+ *
+ * Without liburing, or if the kernel doesn't support io_uring or its statx
+ * operation (before Linux 5.6), the files are stat()ed synchronously, one at
+ * a time, as they're added. A request that fails with anything other than
+ * ENOENT is retried with stat(), so that a file is never dropped from the
+ * model because of an io_uring problem.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef USE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "utils/memutils.h"
+
+#include "pg_quota.h"
+
+/* Number of statx requests kept in flight */
+#define STAT_BATCH_SIZE		256
+
+#ifdef USE_LIBURING
+typedef struct StatRequest
+{
+	RelFileNode rnode;
+	char		path[MAXPGPATH];
+	struct statx statxbuf;
+} StatRequest;
+
+static struct io_uring ring;
+static bool ring_initialized = false;
+static bool ring_failed = false;
+
+static StatRequest *requests;
+static int	nrequests = 0;
+#endif
+
+static ScanFileCallback batch_callback;
+
+static void stat_one(RelFileNode *rnode, const char *path);
+
+#ifdef USE_LIBURING
+/*
+ * Does the kernel support statx requests in io_uring? io_uring itself
+ * appeared in Linux 5.1, but IORING_OP_STATX only in 5.6; before that,
+ * every request fails with EINVAL.
+ */
+static bool
+ring_supports_statx(void)
+{
+	struct io_uring_probe *probe;
+	bool		result;
+
+	/* The probe interface appeared in 5.6 too */
+	probe = io_uring_get_probe_ring(&ring);
+	if (probe == NULL)
+		return false;
+	result = io_uring_opcode_supported(probe, IORING_OP_STATX);
+	io_uring_free_probe(probe);
+
+	return result;
+}
+#endif
+
+/*
+ * Start a batch. 'callback' is called with the size of each file that's
+ * added to the batch, in no particular order, by StatBatchAdd() or
+ * StatBatchFlush().
+ */
+void
+StatBatchBegin(ScanFileCallback callback)
+{
+	batch_callback = callback;
+
+#ifdef USE_LIBURING
+	if (!ring_initialized && !ring_failed)
+	{
+		int			ret;
+
+		ret = io_uring_queue_init(STAT_BATCH_SIZE, &ring, 0);
+		if (ret < 0)
+		{
+			/* Old kernel, or io_uring disabled. Fall back to stat(). */
+			ereport(LOG,
+					(errmsg("could not initialize io_uring, using synchronous stat() calls: %s",
+							strerror(-ret))));
+			ring_failed = true;
+		}
+		else if (!ring_supports_statx())
+		{
+			ereport(LOG,
+					(errmsg("io_uring does not support statx, using synchronous stat() calls")));
+			io_uring_queue_exit(&ring);
+			ring_failed = true;
+		}
+		else
+		{
+			requests = MemoryContextAlloc(TopMemoryContext,
+										  STAT_BATCH_SIZE * sizeof(StatRequest));
+			ring_initialized = true;
+		}
+	}
+	nrequests = 0;
+#endif
+}
+
+/*
+ * Get the size of a file synchronously, and pass it to the callback.
+ */
+static void
+stat_one(RelFileNode *rnode, const char *path)
+{
+	struct stat statbuf;
+	char		pathcopy[MAXPGPATH];
+
+	if (stat(path, &statbuf) != 0)
+	{
+		ereport(DEBUG1,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+		return;
+	}
+
+	strlcpy(pathcopy, path, MAXPGPATH);
+	batch_callback(rnode, pathcopy, statbuf.st_size);
+}
+
+/*
+ * Add a file to the batch. If the batch is full, it's flushed.
+ */
+void
+StatBatchAdd(RelFileNode *rnode, const char *path)
+{
+#ifdef USE_LIBURING
+	if (ring_initialized)
+	{
+		StatRequest *req = &requests[nrequests++];
+
+		req->rnode = *rnode;
+		strlcpy(req->path, path, MAXPGPATH);
+
+		if (nrequests == STAT_BATCH_SIZE)
+			StatBatchFlush();
+		return;
+	}
+#endif
+
+	stat_one(rnode, path);
+}
+
+/*
+ * Get the sizes of all the files added to the batch so far, and pass them to
+ * the callback. Must be called after adding the last file.
+ */
+void
+StatBatchFlush(void)
+{
+#ifdef USE_LIBURING
+	int			i;
+	int			ret;
+
+	if (!ring_initialized || nrequests == 0)
+		return;
+
+	for (i = 0; i < nrequests; i++)
+	{
+		StatRequest *req = &requests[i];
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+		/* The ring is as large as the batch, so this can't run out */
+		Assert(sqe != NULL);
+		io_uring_prep_statx(sqe, AT_FDCWD, req->path, 0, STATX_SIZE,
+							&req->statxbuf);
+		io_uring_sqe_set_data(sqe, req);
+	}
+
+	/* The latch's SIGUSR1 can interrupt the system calls, just retry */
+	do
+		ret = io_uring_submit(&ring);
+	while (ret == -EINTR);
+	if (ret != nrequests)
+		elog(ERROR, "io_uring_submit failed: %s",
+			 ret < 0 ? strerror(-ret) : "not all requests were submitted");
+
+	for (i = 0; i < nrequests; i++)
+	{
+		struct io_uring_cqe *cqe;
+		StatRequest *req;
+
+		do
+			ret = io_uring_wait_cqe(&ring, &cqe);
+		while (ret == -EINTR);
+		if (ret < 0)
+			elog(ERROR, "io_uring_wait_cqe failed: %s", strerror(-ret));
+
+		req = (StatRequest *) io_uring_cqe_get_data(cqe);
+		if (cqe->res == -ENOENT)
+		{
+			/* Removed since the directory was read */
+			errno = ENOENT;
+			ereport(DEBUG1,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", req->path)));
+		}
+		else if (cqe->res < 0)
+			stat_one(&req->rnode, req->path);
+		else
+			batch_callback(&req->rnode, req->path, req->statxbuf.stx_size);
+
+		io_uring_cqe_seen(&ring, cqe);
+	}
+
+	nrequests = 0;
+#endif
+}